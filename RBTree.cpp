@@ -1,140 +1,131 @@
-#include <memory> // for std::unique_ptr
-#include <functional> // for std::less
-#include <string>
-#include <iostream>
-#include <cassert>
-#include <iostream>
-#include <utility>
-#include <numeric>
-#include <vector>
-#include <random>
-#include <set>
-#include <chrono>
-#include <algorithm>
-
-
-enum class Color : bool {black, red};
-enum class side : bool {left, right};
-side get_reverse_side(const side s) { return s == side::right? side::left : side::right; };
-
-struct Multi_insert {
-    std::string message;
-    Multi_insert(std::string s) : message{std::move(s)} {}
-    const char* what() const { return message.c_str(); }
-};
+#include "RBTree.hpp"
+#include "RBTree_storage.hpp"
+#include "RBTree_numa.hpp"
+#include <cctype> // for std::tolower
 
-// Struct to represent Red-Black Tree Node
-template <typename T>
-struct Node {
-    T key;
-    Color color; 
-    std::unique_ptr< Node<T> > left;
-    std::unique_ptr< Node<T> > right;
-    Node<T> *parent;
-
-    public:
-    // default ctor
-    Node() noexcept : color{Color::red}, parent{nullptr}{}
-    // custom ctors
-    explicit Node(const T& key) noexcept : key{key}, color{Color::red}, parent{nullptr} {}
-    explicit Node(T&& key) noexcept : key{std::move(key)}, color{Color::red}, parent{nullptr} {}
-    // default dtor
-    ~Node() noexcept = default;
-
-    // useful methods
-    bool is_root() const { return parent == nullptr; }
-    bool is_leaf() const { return left == nullptr && right == nullptr; }
-    bool is_right_child() const { return !this->is_root() && parent->right == this; }
-    side get_side() const { return is_right_child() ? side::right : side::left; }
-};
+// String keys carry an inline prefix (compared in bench_string_keys):
+template <> struct Key_prefix<std::string> : String_key_prefix {};
 
-template <typename RBTree, typename T>
-class const_iterator {
-    RBTree* current;
-
-    public:
-    // From <iterator> we must specify:
-    using value_type = T; 
-    using reference = value_type&;
-    using pointer = value_type*;
-    using difference_type = std::ptrdiff_t; //#include <iterator>
-    using iterator_category = std::forward_iterator_tag; // we didn't implement operator--, only ++
-
-    explicit const_iterator(RBTree* x) : current{x} {} //ctor
-    //const on right for status not changing assurance:
-    reference operator*() const { return current->key; } //old: T&
-    const_iterator& operator++();  // pre-increment ++i
-    const_iterator operator++(int); // post-increment i++
-    friend bool operator==(const const_iterator& x, const const_iterator& y) {
-          return x.current == y.current;
-    }
-    friend bool operator!=(const const_iterator& x, const const_iterator& y) {
-          return !(x == y); // We can call the operator== since it is friend instead of:
-      // x.current != y.current;
+// Case-insensitive order of strings, and the case-folding hash that lets a
+// Bloom filter or a hash index stand in front of it (checked in bench_bloom
+// and bench_hash_index):
+struct Case_less {
+    bool operator()(const std::string& a, const std::string& b) const {
+        return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](unsigned char x, unsigned char y) {
+            return std::tolower(x) < std::tolower(y);
+        });
     }
 };
-
-// Class to represent Red-Black Tree
-template <typename T, typename CMP=std::less<T>>
-class RBTree {
-    public:
-    std::unique_ptr< Node<T>> root;
-    CMP cmp;
-
-    private:
-    // PRIVATE METHODS
-    Node<T>* search_subtree(Node<T>*, const T&) const;
-    void insert(std::unique_ptr<Node<T>>);
-    // Replace x by y in the tree. It returns the ptr to the removed x:
-    Node<T>* transplant(Node<T>* x, std::unique_ptr<Node<T>>&& y);
-    void rotate_left(std::unique_ptr<Node<T>>&&);
-    void rotate_right(std::unique_ptr<Node<T>>&&);
-    void insert_fixup(std::unique_ptr<Node<T>>&&);
-    void delete_fixup(Node<T>*, Node<T>*);
-    // Delete a node form a Binary Search tree:
-    Node<T>* Delete_BTS(Node<T>* );
-    // Delete a node form a Red Black tree:
-    bool Delete(Node<T>*);
-
-    public:
-    // ctor
-    RBTree() noexcept : cmp{std::less<T>()}{}
-    // default dtor
-    ~RBTree() noexcept = default;
-
-    using _iterator = const_iterator<Node<T>, const T>; //const ref returned
-    auto begin() const { return _iterator{root.get()}; } 
-    auto end() const { return _iterator{nullptr}; }
-
-    // PUBLIC METHODS
-    Node<T>* minimum_in_subtree(Node<T>*) const;
-    Node<T>* maximum_in_subtree(Node<T>*) const;
-    Node<T>* successor(const Node<T>*) const;
-
-    // To search a value from the tree:
-    Node<T>* search_subtree(const T& key) const{ return search_subtree(root.get(), key);};
-    // To insert a new value in the tree:
-    void insert(const T&);
-    // To test whether the tree contains a value:
-    bool contains(const T& key) const{ return search_subtree(key) != nullptr;}; 
-    // To delete a value from the tree:      
-    bool Delete(const T& key) {
-        auto z = search_subtree(key);
-        return Delete(z);
+template <> struct Order_hash<std::string, Case_less> {
+    static constexpr bool enabled = true;
+    std::size_t operator()(const std::string& key) const {
+        std::string folded(key);
+        for (char& c : folded) {
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        return std::hash<std::string>{}(folded);
     }
 };
 
-// To print the tree in-order-walk:
-template <typename T>
-std::ostream& operator<<(std::ostream&, Node<T>*);
-template <typename T, typename CMP>
-std::ostream& operator<<(std::ostream&, const RBTree<T,CMP>&);
-
 // RBTree TESTS:
 std::mt19937 gen(std::random_device{}());
 
-int main() {
-    constexpr size_t SIZE = 10000;
+template <typename Tree, typename K>
+double time_inserts(Tree& tree, const std::vector<K>& v) {
+    auto t1 = std::chrono::steady_clock::now();
+    for (const auto& n : v) {
+        tree.insert(n);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(t2 - t1).count();
+}
+
+template <typename Tree, typename K>
+double time_lookups(const Tree& tree, const std::vector<K>& v) {
+    size_t found = 0;
+    auto t1 = std::chrono::steady_clock::now();
+    for (const auto& n : v) {
+        found += tree.contains(n);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    if (found != v.size()) {
+        std::cerr << "lookup missed " << v.size() - found << " keys\n";
+    }
+    return std::chrono::duration<double, std::milli>(t2 - t1).count();
+}
+
+// The keys, or 1 to min_keys in random order if there are fewer, for the
+// benchmarks that only mean something on large trees:
+std::vector<int> at_least(const std::vector<int>& keys, std::size_t min_keys) {
+    if (keys.size() >= min_keys) {
+        return keys;
+    }
+    std::vector<int> v(min_keys);
+    std::iota(v.begin(), v.end(), 1);
+    std::shuffle(v.begin(), v.end(), gen);
+    return v;
+}
+
+template <typename Tree, typename K>
+double time_deletes(Tree& tree, const std::vector<K>& v) {
+    auto t1 = std::chrono::steady_clock::now();
+    for (const auto& n : v) {
+        tree.Delete(n);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(t2 - t1).count();
+}
+
+// Compare the balancing policies on the same keys:
+void bench_balance_policies(const std::vector<int>&);
+// Burst of deletes: eager Delete against tombstones plus compaction:
+void bench_lazy_delete(const std::vector<int>&);
+// Zipf-distributed lookups with and without the hot-key cache, and
+// ascending lookups with and without finger search:
+void bench_hot_keys(const std::vector<int>&);
+// String keys with and without the inline key prefix:
+void bench_string_keys(size_t);
+// Timer queue: pop the next deadline and re-arm it, against std containers:
+void bench_timer_queue(size_t);
+// Fixed lookup set built at compile time against one built at startup:
+void bench_static_table();
+// Paged tree whose nodes take 10x the pages of its buffer pool:
+void bench_paged_tree(const std::vector<int>&);
+// Durable inserts: fsync per record against group commit, and recovery:
+void bench_wal(size_t);
+// Dumping the tree: ostream insertions per key against the buffered exporters:
+void bench_export(const std::vector<int>&);
+// Building from at least 10M unsorted keys: serial inserts against build_parallel:
+void bench_build_parallel(const std::vector<int>&);
+// Whole-tree scans of at least 50M keys: the iterator against parallel_reduce and parallel_for_each:
+void bench_parallel_scan(const std::vector<int>&);
+// Mixed reads and writes from many threads: Chromatic_tree against a locked RBTree:
+void bench_concurrent_writers(size_t);
+// TTL keys: scanning and deleting the due keys one by one against Expiry_index:
+void bench_expiry(size_t);
+// Point lookups through the tree against the hash index of Hashed_RBTree:
+void bench_hash_index(const std::vector<int>&);
+// Node footprint and lookups after churn, then after compacting in order and in vEB order:
+void bench_compact(const std::vector<int>&);
+// Percentiles of every phase of insert, Delete and contains:
+void bench_latency(const std::vector<int>&);
+// Moving keys between trees with node handles and merge, and erase(iterator):
+void bench_node_handles(const std::vector<int>&);
+// Mostly-missing lookups with a Bloom filter of several sizes in front of the tree:
+void bench_bloom(const std::vector<int>&);
+// Readers on two simulated NUMA nodes: one locked tree against a replica per node:
+void bench_replicas(const std::vector<int>&);
+// Integer keys under a radix directory of 2^8 and 2^12 trees against one tree:
+void bench_radix(const std::vector<int>&);
+// Random inserts staged in a write buffer and merged in sorted batches, on
+// at least 1M keys (buffers only pay off once the tree outgrows the cache):
+void bench_write_buffer(const std::vector<int>&);
+// Lookups interleaved as coroutines on one thread against a contains loop, in
+// a tree of at least four times the last level cache:
+void bench_async_find(const std::vector<int>&);
+
+int main(int argc, char* argv[]) {
+    const size_t SIZE = argc > 1 ? std::stoul(argv[1]) : 10000;
     std::vector<int> v (SIZE);
     //Fills the range [first, last) with sequentially increasing values, starting with 1:
     std::iota(v.begin(), v.end(), 1);
@@ -142,15 +133,19 @@ int main() {
     std::shuffle(v.begin(), v.end(), gen);
 
     RBTree<int> rbtree;
-    auto t1 = std::chrono::steady_clock::now();
-    for (auto n : v) {
-        rbtree.insert(n);
-    }
-    auto t2 = std::chrono::steady_clock::now();
-    auto dt1 = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
+    TopDownRBTree<int> tdtree;
+    auto dt1 = time_inserts(rbtree, v);
+    auto dt2 = time_inserts(tdtree, v);
 
     std::cout << "Inserting " << SIZE << " elements:\n";
-    std::cout << "unique ptr red-black tree : " << dt1.count() << " ms\n";
+    std::cout << "unique ptr red-black tree : " << dt1 << " ms\n";
+    std::cout << "top-down red-black tree   : " << dt2 << " ms\n";
+
+    std::cout << "\nNode size:\n";
+    std::cout << "unique ptr red-black tree : " << sizeof(Node<int>) << " bytes, "
+              << SIZE * sizeof(Node<int>) / 1024 << " KiB of nodes\n";
+    std::cout << "top-down red-black tree   : " << sizeof(TDNode<int>) << " bytes, "
+              << SIZE * sizeof(TDNode<int>) / 1024 << " KiB of nodes\n";
 
     if(SIZE<=100){
         std::cout << "\nInorder walk:\n";
@@ -173,436 +168,1158 @@ int main() {
 
     std::shuffle(v.begin(), v.end(), gen);
 
-    t1 = std::chrono::steady_clock::now();
-    for (auto n : v) {
-        rbtree.Delete(n);
-    }
-    t2 = std::chrono::steady_clock::now();
-    auto dt3 = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
+    dt1 = time_lookups(rbtree, v);
+    dt2 = time_lookups(tdtree, v);
 
+    std::cout << "\nSearching " << SIZE << " elements:\n";
+    std::cout << "unique ptr red-black tree : " << dt1 << " ms\n";
+    std::cout << "top-down red-black tree   : " << dt2 << " ms\n";
+
+    dt1 = time_deletes(rbtree, v);
+    dt2 = time_deletes(tdtree, v);
 
     std::cout << "\nDeleting " << SIZE << " elements:\n";
-    std::cout << "unique ptr red-black tree : " << dt3.count() << " ms\n";
+    std::cout << "unique ptr red-black tree : " << dt1 << " ms\n";
+    std::cout << "top-down red-black tree   : " << dt2 << " ms\n";
+
+    bench_balance_policies(v);
+    bench_lazy_delete(v);
+    bench_hot_keys(v);
+    bench_string_keys(SIZE);
+    bench_timer_queue(SIZE);
+    bench_static_table();
+    bench_paged_tree(v);
+    bench_wal(SIZE);
+    bench_export(v);
+    bench_build_parallel(v);
+    bench_parallel_scan(v);
+    bench_concurrent_writers(SIZE);
+    bench_expiry(SIZE);
+    bench_hash_index(v);
+    bench_compact(v);
+    bench_latency(v);
+    bench_node_handles(v);
+    bench_bloom(v);
+    bench_replicas(v);
+    bench_radix(v);
+    bench_write_buffer(v);
+    bench_async_find(v);
     return 0;
 }
 
 
-///////////////////////// RBTree IMPLEMENTATION /////////////////////////
-// RBTree PUBLIC METHODS
-template <typename T, typename CMP>
-Node<T>* RBTree<T, CMP>::minimum_in_subtree(Node<T>* node) const {    
-    if (!node) {
-        return node;
+///////////////////////// BENCHMARKS /////////////////////////
+template <typename Balance>
+void bench_balance_policy(const char* name, const std::vector<int>& v) {
+    RBTree<int, std::less<int>, Balance> tree;
+    tree.count_rotations();
+    auto ins = time_inserts(tree, v);
+    auto ins_rot = tree.rotations();
+    auto depth = tree.average_depth();
+    auto look = time_lookups(tree, v);
+    auto del = time_deletes(tree, v);
+    auto del_rot = tree.rotations() - ins_rot;
+    auto flags = std::cout.flags();
+    auto precision = std::cout.precision();
+    std::cout << std::left << std::setw(10) << name << std::right
+              << std::fixed << std::setprecision(2) << std::setw(8) << depth
+              << std::setw(12) << static_cast<double>(ins_rot) / v.size()
+              << std::setw(12) << static_cast<double>(del_rot) / v.size()
+              << std::setw(11) << ins << std::setw(11) << look << std::setw(11) << del << '\n';
+    std::cout.flags(flags);
+    std::cout.precision(precision);
+}
+
+void bench_balance_policies(const std::vector<int>& v) {
+    std::cout << "\nBalancing policies on " << v.size() << " elements:\n";
+    std::cout << "policy       depth  rot/insert  rot/delete  insert ms  search ms  delete ms\n";
+    bench_balance_policy<RB_balance>("RB", v);
+    bench_balance_policy<AVL_balance>("AVL", v);
+    bench_balance_policy<WAVL_balance>("WAVL", v);
+    bench_balance_policy<LLRB_balance>("LLRB", v);
+}
+
+void bench_lazy_delete(const std::vector<int>& v) {
+    std::vector<int> burst(v.begin(), v.begin() + v.size() / 2);
+    RBTree<int> eager;
+    RBTree<int> lazy;
+    RBTree<int> automatic;
+    time_inserts(eager, v);
+    time_inserts(lazy, v);
+    time_inserts(automatic, v);
+    lazy.set_lazy_delete(true, 1.0); // compact only on demand
+    automatic.set_lazy_delete(true);
+
+    auto dt1 = time_deletes(eager, burst);
+    auto dt2 = time_deletes(lazy, burst);
+    auto t1 = std::chrono::steady_clock::now();
+    auto freed = lazy.compact_tombstones();
+    auto t2 = std::chrono::steady_clock::now();
+    auto dt3 = std::chrono::duration<double, std::milli>(t2 - t1).count();
+    auto dt4 = time_deletes(automatic, burst);
+
+    std::cout << "\nDeleting a burst of " << burst.size() << " elements:\n";
+    std::cout << "eager delete              : " << dt1 << " ms\n";
+    std::cout << "tombstones                : " << dt2 << " ms\n";
+    std::cout << "compaction                : " << dt3 << " ms, "
+              << freed / 1024 << " KiB reclaimed\n";
+    std::cout << "tombstones, auto compact  : " << dt4 << " ms\n";
+}
+
+void bench_hot_keys(const std::vector<int>& v) {
+    // Key of rank r is drawn with probability proportional to 1/(r+1)^1.2:
+    std::vector<double> weights(v.size());
+    for (size_t r = 0; r < weights.size(); ++r) {
+        weights[r] = 1.0 / std::pow(r + 1.0, 1.2);
     }
-    while (node->left) {
-        node = node->left.get();
+    std::discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+    std::vector<int> lookups(v.size());
+    for (auto& k : lookups) {
+        k = v[zipf(gen)];
     }
-    return node;
+
+    RBTree<int> rbtree;
+    time_inserts(rbtree, v);
+    auto dt1 = time_lookups(rbtree, lookups);
+    rbtree.enable_hot_cache(4096);
+    auto dt2 = time_lookups(rbtree, lookups);
+
+    std::cout << "\nSearching " << lookups.size() << " Zipf-distributed elements:\n";
+    std::cout << "from the root             : " << dt1 << " ms\n";
+    std::cout << "hot-key cache (4096)      : " << dt2 << " ms\n";
+
+    std::vector<int> ascending(v);
+    std::sort(ascending.begin(), ascending.end());
+    size_t found = 0;
+    auto t1 = std::chrono::steady_clock::now();
+    for (auto n : ascending) {
+        found += rbtree.find(n) != rbtree.end();
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    auto hint = rbtree.begin();
+    for (auto n : ascending) {
+        hint = rbtree.find(hint, n);
+        found += hint != rbtree.end();
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    if (found != 2 * ascending.size()) {
+        std::cerr << "finger search missed " << 2 * ascending.size() - found << " keys\n";
+    }
+
+    std::cout << "\nSearching " << ascending.size() << " ascending elements:\n";
+    std::cout << "from the root             : "
+              << std::chrono::duration<double, std::milli>(t2 - t1).count() << " ms\n";
+    std::cout << "finger search             : "
+              << std::chrono::duration<double, std::milli>(t3 - t2).count() << " ms\n";
 }
 
-template <typename T, typename CMP>
-Node<T>* RBTree<T,CMP>::maximum_in_subtree(Node<T>* node) const {    
-    if (!node) {
-        return node;
+// Same order as std::less<std::string>, but hides it from the prefix test:
+struct Plain_string_less {
+    bool operator()(const std::string& a, const std::string& b) const { return a < b; }
+};
+
+void bench_string_keyset(const char* name, const std::vector<std::string>& keys) {
+    std::vector<std::string> shuffled(keys);
+    std::shuffle(shuffled.begin(), shuffled.end(), gen);
+    RBTree<std::string> prefixed;
+    RBTree<std::string, Plain_string_less> plain;
+    auto dt1 = time_inserts(plain, keys);
+    auto dt2 = time_inserts(prefixed, keys);
+    auto dt3 = time_lookups(plain, shuffled);
+    auto dt4 = time_lookups(prefixed, shuffled);
+    std::cout << "\n" << name << " keys, e.g. " << keys.front() << ":\n";
+    std::cout << "insert, full compare      : " << dt1 << " ms\n";
+    std::cout << "insert, inline prefix     : " << dt2 << " ms\n";
+    std::cout << "search, full compare      : " << dt3 << " ms\n";
+    std::cout << "search, inline prefix     : " << dt4 << " ms\n";
+}
+
+void bench_string_keys(size_t size) {
+    const char* hex = "0123456789abcdef";
+    std::uniform_int_distribution<int> nibble(0, 15);
+    std::set<std::string> uuids;
+    while (uuids.size() < size) {
+        std::string u(36, '-');
+        for (size_t i = 0; i < u.size(); ++i) {
+            if (i != 8 && i != 13 && i != 18 && i != 23) {
+                u[i] = hex[nibble(gen)];
+            }
+        }
+        uuids.insert(u);
     }
-    while (node->right) {
-        node = node->right.get();
+    std::vector<std::string> urls(size);
+    const char* hosts[] = {"www.example.com", "cdn.example.net", "api.service.io", "shop.store.org"};
+    for (size_t i = 0; i < size; ++i) {
+        urls[i] = std::string{"https://"} + hosts[i % 4] + "/items/" + std::to_string(gen() % 1000)
+                  + "/" + std::to_string(i) + "?ref=home";
     }
-    return node;
+    std::vector<std::string> v(uuids.begin(), uuids.end());
+    std::shuffle(v.begin(), v.end(), gen);
+    std::shuffle(urls.begin(), urls.end(), gen);
+    bench_string_keyset("UUID-like", v);
+    bench_string_keyset("URL-like", urls);
 }
 
-template <typename T, typename CMP>
-Node<T>* RBTree<T,CMP>::successor(const Node<T>* node) const{
-    if (node->right) {
-        return minimum_in_subtree(node->right);
+// Run `ops` expirations over `timers` armed timers: take the earliest
+// deadline and re-arm it later. Keys are (deadline << 32 | sequence number).
+template <typename Front, typename Pop, typename Push>
+double run_timer_queue(size_t timers, size_t ops, Front front, Pop pop, Push push) {
+    std::mt19937_64 rng(7);
+    std::uniform_int_distribution<std::uint64_t> delay(1, 1000000);
+    std::uint64_t seq = 0;
+    for (size_t i = 0; i < timers; ++i) {
+        push(delay(rng) << 32 | seq++);
     }
-    Node<T>* parent = node->parent;
-    while (parent && node->is_right_child()) {
-        node = parent;
-        parent = parent->parent;
+    auto t1 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; ++i) {
+        std::uint64_t now = front() >> 32;
+        pop();
+        push((now + delay(rng)) << 32 | seq++);
     }
-    return parent;
+    auto t2 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(t2 - t1).count();
+}
+
+void bench_timer_queue(size_t size) {
+    RBTree<std::uint64_t> rbtree;
+    std::priority_queue<std::uint64_t, std::vector<std::uint64_t>, std::greater<std::uint64_t>> heap;
+    std::set<std::uint64_t> set;
+    auto dt1 = run_timer_queue(size, size,
+        [&] { return rbtree.front(); }, [&] { rbtree.pop_min(); }, [&](std::uint64_t k) { rbtree.insert(k); });
+    auto dt2 = run_timer_queue(size, size,
+        [&] { return heap.top(); }, [&] { heap.pop(); }, [&](std::uint64_t k) { heap.push(k); });
+    auto dt3 = run_timer_queue(size, size,
+        [&] { return *set.begin(); }, [&] { set.erase(set.begin()); }, [&](std::uint64_t k) { set.insert(k); });
+
+    std::cout << "\nTimer queue, " << size << " expirations over " << size << " timers:\n";
+    std::cout << "red-black tree pop_min    : " << dt1 << " ms\n";
+    std::cout << "std::priority_queue       : " << dt2 << " ms\n";
+    std::cout << "std::set                  : " << dt3 << " ms\n";
 }
 
-template <typename T, typename CMP>
-void RBTree<T,CMP>::insert(const T& key) {
-    auto z = std::make_unique<Node<T>>(key);
+// HTTP status codes and C++ keywords, built during compilation:
+constexpr auto http_status = make_static_rbtree(std::array{
+    100, 101, 200, 201, 202, 204, 206, 301, 302, 303, 304, 307, 308, 400, 401, 403,
+    404, 405, 406, 408, 409, 410, 411, 412, 413, 414, 415, 416, 418, 422, 426, 428,
+    429, 431, 451, 500, 501, 502, 503, 504, 505});
+constexpr std::array<std::string_view, 48> cpp_keyword_list{
+    "alignas", "alignof", "auto", "bool", "break", "case", "catch", "char", "class", "concept",
+    "const", "consteval", "constexpr", "continue", "co_await", "co_return", "co_yield", "decltype",
+    "default", "delete", "do", "double", "else", "enum", "explicit", "extern", "false", "float",
+    "for", "friend", "if", "inline", "int", "long", "namespace", "new", "noexcept", "nullptr",
+    "operator", "private", "protected", "public", "requires", "return", "static", "struct",
+    "template", "this"};
+constexpr auto cpp_keywords = make_static_rbtree(cpp_keyword_list);
+static_assert(http_status.contains(404) && !http_status.contains(299), "static tree lookup");
+static_assert(cpp_keywords.contains("constexpr") && !cpp_keywords.contains("main"), "static tree lookup");
+static_assert(*http_status.begin() == 100 && cpp_keywords.size() == 48, "static tree layout");
+
+void bench_static_table() {
+    const size_t rounds = 1000;
+    std::vector<int> probes(10000);
+    std::uniform_int_distribution<int> code(100, 599);
+    for (auto& p : probes) {
+        p = code(gen);
+    }
+    size_t hits1 = 0, hits2 = 0;
+    auto t1 = std::chrono::steady_clock::now();
+    RBTree<int> runtime;
+    for (auto c : http_status) {
+        runtime.insert(c);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; ++r) {
+        for (auto p : probes) {
+            hits1 += runtime.contains(p);
+        }
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; ++r) {
+        for (auto p : probes) {
+            hits2 += http_status.contains(p);
+        }
+    }
+    auto t4 = std::chrono::steady_clock::now();
+    if (hits1 != hits2) {
+        std::cerr << "static table disagrees with RBTree\n";
+    }
+    std::cout << "\nFixed set of " << http_status.size() << " status codes, "
+              << rounds * probes.size() << " lookups:\n";
+    std::cout << "RBTree build at startup   : " << std::chrono::duration<double, std::milli>(t2 - t1).count() << " ms\n";
+    std::cout << "RBTree contains           : " << std::chrono::duration<double, std::milli>(t3 - t2).count() << " ms\n";
+    std::cout << "Static_RBTree contains    : " << std::chrono::duration<double, std::milli>(t4 - t3).count() << " ms\n";
+}
+
+void bench_paged_tree(const std::vector<int>& v) {
+    const std::size_t pages = v.size() * sizeof(PNode<int>) / Buffer_pool::page_size + 1;
+    const std::size_t frames = std::max<std::size_t>(4, pages / 10);
+    const auto path = (std::filesystem::temp_directory_path() / "rbtree_pages.bin").string();
+    std::vector<int> order(v);
+    std::cout << "\nPaged tree, " << v.size() << " elements in ~" << pages << " pages, pool of "
+              << frames << " frames:\n";
+    std::cout << "phase       time ms   hit rate      reads     writes\n";
     try {
-        insert(std::move(z));
-    } catch (const Multi_insert& e) {
+        PagedRBTree<int> tree(path, frames);
+        std::size_t hits = 0, reads = 0, writes = 0;
+        auto report = [&](const char* phase, double ms) {
+            const auto& pool = tree.buffer_pool();
+            auto h = pool.hits - hits, r = pool.reads - reads;
+            auto flags = std::cout.flags();
+            auto precision = std::cout.precision();
+            std::cout << std::left << std::setw(8) << phase << std::right << std::fixed << std::setprecision(2)
+                      << std::setw(12) << ms << std::setw(10) << 100.0 * h / (h + r) << '%'
+                      << std::setw(11) << r << std::setw(11) << pool.writes - writes << '\n';
+            std::cout.flags(flags);
+            std::cout.precision(precision);
+            hits = pool.hits;
+            reads = pool.reads;
+            writes = pool.writes;
+        };
+        report("insert", time_inserts(tree, order));
+        std::shuffle(order.begin(), order.end(), gen);
+        report("search", time_lookups(tree, order));
+        std::shuffle(order.begin(), order.end(), gen);
+        report("delete", time_deletes(tree, order));
+    } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
-    } catch (...) {
-        std::cerr << "Unknown exception. Aborting.\n";
-        //std::abort();
     }
+    std::filesystem::remove(path);
 }
 
+void bench_wal(size_t size) {
+    const auto dir = (std::filesystem::temp_directory_path() / "rbtree_wal").string();
+    const size_t ops = std::min<size_t>(size, 2000);
+    std::cout << "\nDurable inserts, " << ops << " records:\n";
+    std::cout << "mode                          ops/s  records/sync\n";
+    auto run = [&](const char* mode, bool group, unsigned threads) {
+        std::filesystem::remove_all(dir);
+        Durable_RBTree<int> tree(dir, group);
+        auto t1 = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                for (size_t i = t; i < ops; i += threads) {
+                    tree.insert(static_cast<int>(i));
+                }
+            });
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        auto flags = std::cout.flags();
+        auto precision = std::cout.precision();
+        std::cout << std::left << std::setw(24) << mode << std::right << std::fixed << std::setprecision(0)
+                  << std::setw(11) << ops / std::chrono::duration<double>(t2 - t1).count()
+                  << std::setprecision(1) << std::setw(14) << static_cast<double>(ops) / tree.sync_count() << '\n';
+        std::cout.flags(flags);
+        std::cout.precision(precision);
+    };
+    try {
+        run("fsync per record", false, 1);
+        run("group commit, 1 thread", true, 1);
+        run("group commit, 4 threads", true, 4);
+        run("group commit, 16 threads", true, 16);
+        run("group commit, 64 threads", true, 64);
+
+        // Checkpoint every quarter of the records, then recover from the snapshot and the log tail:
+        std::filesystem::remove_all(dir);
+        {
+            Durable_RBTree<int> tree(dir, true, ops / 4 + 1);
+            for (size_t i = 0; i < ops; ++i) {
+                tree.insert(static_cast<int>(i));
+            }
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        Durable_RBTree<int> recovered(dir);
+        auto t2 = std::chrono::steady_clock::now();
+        std::cout << "recovery                  : " << std::chrono::duration<double, std::milli>(t2 - t1).count()
+                  << " ms, " << recovered.size() << " keys\n";
 
-// RBTree PRIVATE METHODS
-template <typename T, typename CMP>
-Node<T>* RBTree<T,CMP>::search_subtree(Node<T>* node, const T& key) const{
-    if(!node || key == node->key)
-        return node;
-    if(cmp(key, node->key))
-        return search_subtree(node->left.get(), key);
-    else
-        return search_subtree(node->right.get(), key);
+        // Failure injection: swap /dev/full in for the log, so that every
+        // write fails with ENOSPC. No failed change may reach the tree or
+        // survive a restart, and every caller must get the error.
+        std::filesystem::remove_all(dir);
+        std::size_t rejected = 0, kept = 0;
+        {
+            Durable_RBTree<int> tree(dir);
+            tree.insert(-1);
+            const auto log = std::filesystem::canonical(dir + "/wal.log");
+            int full = ::open("/dev/full", O_WRONLY);
+            for (const auto& fd : std::filesystem::directory_iterator{"/proc/self/fd"}) {
+                std::error_code ec;
+                if (full >= 0 && std::filesystem::read_symlink(fd.path(), ec) == log) {
+                    ::dup2(full, std::stoi(fd.path().filename().string()));
+                }
+            }
+            ::close(full);
+            std::mutex count_m;
+            std::vector<std::thread> workers;
+            for (int t = 0; t < 8; ++t) {
+                workers.emplace_back([&, t] {
+                    for (int i = t; i < 64; i += 8) {
+                        try {
+                            i % 16 ? tree.insert(i) : tree.Delete(-1);
+                        } catch (const std::exception&) {
+                            std::lock_guard<std::mutex> lk{count_m};
+                            ++rejected;
+                        }
+                    }
+                });
+            }
+            for (auto& w : workers) {
+                w.join();
+            }
+            kept = tree.size();
+        }
+        Durable_RBTree<int> reopened(dir);
+        std::cout << "failed log writes         : " << rejected << " of 64 changes rejected, "
+                  << kept << " key in the tree, " << reopened.size() << " after recovery\n";
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    std::filesystem::remove_all(dir);
 }
 
-template <typename T, typename CMP>
-void RBTree<T,CMP>::insert(std::unique_ptr<Node<T>> node){
-    Node<T>* x = root.get();
-    Node<T>* y = root.get();
-    while (x) {
-        y = x;
-        if (cmp(node->key, x->key)) {
-            if (cmp(x->key, node->key)){
-                throw Multi_insert{
-                    "Cannot handle multiple insertions. You gave me " +
-                    std::to_string(x->key)
-                };
-            }
-            x = x->left.get();
-        } else {
-            x = x->right.get();
+void bench_export(const std::vector<int>& v) {
+    RBTree<int> tree;
+    time_inserts(tree, v);
+    std::ofstream null{"/dev/null"};
+    auto timed = [](auto&& f) {
+        auto t1 = std::chrono::steady_clock::now();
+        f();
+        auto t2 = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::milli>(t2 - t1).count();
+    };
+    std::size_t bytes[3] = {};
+    auto counted = [&](Export_format format) {
+        tree.export_to(format, [&](const char* s, std::size_t n) {
+            bytes[static_cast<int>(format)] += n;
+            null.write(s, static_cast<std::streamsize>(n));
+        });
+    };
+    auto dt1 = timed([&] {
+        for (auto k : tree) {
+            null << k << '\n';
         }
+    });
+    auto dt2 = timed([&] { counted(Export_format::keys); });
+    auto dt3 = timed([&] { counted(Export_format::dot); });
+    auto dt4 = timed([&] { counted(Export_format::json); });
+
+    std::cout << "\nExporting " << v.size() << " elements to /dev/null:\n";
+    std::cout << "keys, ostream per key     : " << dt1 << " ms\n";
+    std::cout << "keys, exporter            : " << dt2 << " ms, " << bytes[0] / 1024 << " KiB\n";
+    std::cout << "DOT, exporter             : " << dt3 << " ms, " << bytes[1] / 1024 << " KiB\n";
+    std::cout << "JSON, exporter            : " << dt4 << " ms, " << bytes[2] / 1024 << " KiB\n";
+
+    // JSON has no literal for the infinities, so they go out as strings:
+    RBTree<double> extremes;
+    for (double key : {-HUGE_VAL, 0.5, HUGE_VAL}) {
+        extremes.insert(key);
     }
-    node->parent = y;
-    // Restore RB properties:
-    if (!y) {
-        root = std::move(node);
-        insert_fixup(std::move(root));
-    } else if (cmp(node->key, y->key)) {
-        y->left = std::move(node);
-        insert_fixup(std::move(y->left));
-    } else {
-        y->right = std::move(node);
-        insert_fixup(std::move(y->right));
+    std::ostringstream json;
+    extremes.export_to(Export_format::json, json);
+    if (json.str().find(":inf") != std::string::npos || json.str().find(":-inf") != std::string::npos) {
+        std::cerr << "JSON export left an infinite key bare\n";
     }
+    std::cout << "JSON of {-inf, 0.5, inf}  : " << json.str();
 }
 
-template <typename T, typename CMP>
-void RBTree<T,CMP>::rotate_left(std::unique_ptr<Node<T>>&& x){
-    auto y = std::move(x->right);
-    x->right = std::move(y->left);
-    if (x->right) {
-        x->right->parent = x.get();
-    }
-    y->parent = x->parent;
-    auto xp = x->parent;
-    if (!xp) {
-        auto px = x.release();
-        root = std::move(y);
-        root->left = std::unique_ptr<Node<T>>(px);
-        root->left->parent = root.get();
-    } else if (x == xp->left) {
-        auto px = x.release();
-        xp->left = std::move(y);
-        xp->left->left = std::unique_ptr<Node<T>>(px);
-        xp->left->left->parent = xp->left.get();
-    } else {
-        auto px = x.release();
-        xp->right = std::move(y);
-        xp->right->left = std::unique_ptr<Node<T>>(px);
-        xp->right->left->parent = xp->right.get();
+void bench_build_parallel(const std::vector<int>& keys) {
+    // Below millions of keys the threads cost more to start than they save:
+    const std::vector<int> v = at_least(keys, 10'000'000);
+    std::cout << "\nBuilding from " << v.size() << " unsorted elements:\n";
+    double serial;
+    {
+        RBTree<int> tree;
+        serial = time_inserts(tree, v);
+        std::cout << "serial inserts            : " << serial << " ms\n";
+    }
+    // powers of two up to the number of cores
+    const unsigned most = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<unsigned> counts;
+    for (unsigned threads = 1; threads < most; threads *= 2) {
+        counts.push_back(threads);
+    }
+    counts.push_back(most);
+    for (auto threads : counts) {
+        RBTree<int> tree;
+        auto t1 = std::chrono::steady_clock::now();
+        tree.build_parallel(v.begin(), v.end(), threads);
+        auto t2 = std::chrono::steady_clock::now();
+        const double ms = std::chrono::duration<double, std::milli>(t2 - t1).count();
+        std::cout << "build_parallel, " << std::setw(3) << threads << " threads : " << ms << " ms (" << serial / ms
+                  << "x)\n";
+        if (tree.size() != v.size()) {
+            std::cerr << "build_parallel lost keys\n";
+        }
     }
 }
 
-template <typename T, typename CMP>
-void RBTree<T,CMP>::rotate_right(std::unique_ptr<Node<T>>&& x){
-    auto y = std::move(x->left);
-    x->left = std::move(y->right);
-    if (x->left) {
-        x->left->parent = x.get();
-    }
-    y->parent = x->parent;
-    auto xp = x->parent;
-    if (!xp) {
-        auto px = x.release();
-        root = std::move(y);
-        root->right = std::unique_ptr<Node<T>>(px);
-        root->right->parent = root.get();
-    } else if (x == xp->left) {
-        auto px = x.release();
-        xp->left = std::move(y);
-        xp->left->right = std::unique_ptr<Node<T>>(px);
-        xp->left->right->parent = xp->left.get();
-    } else {
-        auto px = x.release();
-        xp->right = std::move(y);
-        xp->right->right = std::unique_ptr<Node<T>>(px);
-        xp->right->right->parent = xp->right.get();
+void bench_parallel_scan(const std::vector<int>& keys) {
+    using Histogram = std::array<std::size_t, 16>;
+    RBTree<std::uint64_t> tree;
+    {
+        // Smaller trees only time the pool handing out tasks:
+        const std::vector<int> v = at_least(keys, 50'000'000);
+        tree.build_parallel(v.begin(), v.end());
+    }
+    auto ms = [](auto t1, auto t2) { return std::chrono::duration<double, std::milli>(t2 - t1).count(); };
+    auto add = [](Histogram a, const Histogram& b) {
+        for (std::size_t i = 0; i < a.size(); ++i) {
+            a[i] += b[i];
+        }
+        return a;
+    };
+    auto count = [](Histogram h, std::uint64_t key) {
+        ++h[key % h.size()];
+        return h;
+    };
+
+    auto t1 = std::chrono::steady_clock::now();
+    auto serial = std::accumulate(tree.begin(), tree.end(), std::uint64_t{0});
+    auto t2 = std::chrono::steady_clock::now();
+    std::cout << "\nScanning " << tree.size() << " elements:\n";
+    std::cout << "iterator sum              : " << ms(t1, t2) << " ms\n";
+    std::cout << "threads     sum ms  histogram ms  for_each ms\n";
+    const unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned threads : {1u, 2u, 4u, 8u, 16u, 32u}) {
+        if (threads > cores) {
+            break;
+        }
+        Work_stealing_pool pool{threads - 1}; // the waiting thread is the last one
+        t1 = std::chrono::steady_clock::now();
+        auto sum = tree.parallel_reduce(std::uint64_t{0}, std::plus<>{}, std::plus<>{}, 8, pool);
+        t2 = std::chrono::steady_clock::now();
+        auto hist = tree.parallel_reduce(Histogram{}, count, add, 8, pool);
+        auto t3 = std::chrono::steady_clock::now();
+        std::atomic<std::size_t> sevens{0};
+        tree.parallel_for_each([&](std::uint64_t key) {
+            if (key % 7 == 0) {
+                sevens.fetch_add(1, std::memory_order_relaxed);
+            }
+        }, 8, pool);
+        auto t4 = std::chrono::steady_clock::now();
+        if (sum != serial || std::accumulate(hist.begin(), hist.end(), std::size_t{0}) != tree.size()
+            || sevens != tree.size() / 7) {
+            std::cerr << "parallel scan disagrees with the iterator\n";
+        }
+        auto flags = std::cout.flags();
+        auto precision = std::cout.precision();
+        std::cout << std::fixed << std::setprecision(2) << std::setw(7) << threads << std::setw(11) << ms(t1, t2)
+                  << std::setw(14) << ms(t2, t3) << std::setw(13) << ms(t3, t4) << '\n';
+        std::cout.flags(flags);
+        std::cout.precision(precision);
     }
 }
 
-template <typename T, typename CMP>
-void RBTree<T,CMP>::insert_fixup(std::unique_ptr<Node<T>>&& z){
-    auto zp = z->parent;
-    while (zp && zp->color == Color::red) {
-        auto zpp = zp->parent;
-        if (zp == zpp->left.get()) {
-            auto y = zpp->right.get();
-            if (y && y->color == Color::red) {
-                zp->color = Color::black;
-                y->color = Color::black;
-                zpp->color = Color::red;
-                zp = zpp->parent;
-            } else {
-                if (z == zp->right) {
-                    rotate_left(std::move(zpp->left));
-                    zp = zpp->left.get();
-                }
-                zp->color = Color::black;
-                zpp->color = Color::red;
-                auto zppp = zpp->parent;
-                if (!zppp) {
-                    rotate_right(std::move(root));
-                } else if (zpp == zppp->left.get()) {
-                    rotate_right(std::move(zppp->left));
-                } else {
-                    rotate_right(std::move(zppp->right));
+void bench_concurrent_writers(size_t size) {
+    const int range = static_cast<int>(size);
+    const std::size_t ops = 2 * size;
+    // Every thread draws its own operations: half lookups, a quarter inserts
+    // and a quarter deletes, on keys uniform over the range.
+    auto run = [&](unsigned threads, auto&& op) {
+        std::vector<std::thread> pool;
+        auto t1 = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < threads; ++i) {
+            pool.emplace_back([&, i] {
+                std::mt19937 rng{i + 1};
+                for (std::size_t n = 0; n < ops / threads; ++n) {
+                    auto r = rng();
+                    op(r % 4, static_cast<int>(r / 4 % range));
                 }
+            });
+        }
+        for (auto& t : pool) {
+            t.join();
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        return ops / std::chrono::duration<double, std::micro>(t2 - t1).count();
+    };
+
+    // More threads than cores would only time the scheduler:
+    const unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+    std::cout << "\nMixed operations (50% contains, 25% insert, 25% Delete) over " << size << " keys:\n";
+    std::cout << "threads  chromatic Mops/s  locked RBTree Mops/s\n";
+    for (unsigned threads : {1u, 2u, 4u, 8u, 16u, 32u}) {
+        if (threads > cores) {
+            break;
+        }
+        Chromatic_tree<int> chromatic;
+        RBTree<int> locked;
+        std::shared_mutex m;
+        for (int key = 0; key < range; key += 2) {
+            chromatic.insert(key);
+            locked.insert(key);
+        }
+        auto c = run(threads, [&](unsigned op, int key) {
+            if (op < 2) chromatic.contains(key);
+            else if (op == 2) chromatic.insert(key);
+            else chromatic.Delete(key);
+        });
+        auto l = run(threads, [&](unsigned op, int key) {
+            if (op < 2) {
+                std::shared_lock<std::shared_mutex> lk{m};
+                locked.contains(key);
+                return;
             }
-        } else {
-            auto y = zpp->left.get();
-            if (y && y->color == Color::red) {
-                zp->color = Color::black;
-                y->color = Color::black;
-                zpp->color = Color::red;
-                zp = zpp->parent;
-            } else {
-                if (z == zp->left) {
-                    rotate_right(std::move(zpp->right));
-                    zp = zpp->right.get();
-                }
-                zp->color = Color::black;
-                zpp->color = Color::red;
-                auto zppp = zpp->parent;
-                if (!zppp) {
-                    rotate_left(std::move(root));
-                } else if (zpp == zppp->left.get()) {
-                    rotate_left(std::move(zppp->left));
-                } else {
-                    rotate_left(std::move(zppp->right));
-                }
+            std::unique_lock<std::shared_mutex> lk{m};
+            if (op == 2 && !locked.contains(key)) locked.insert(key);
+            else if (op == 3 && locked.contains(key)) locked.Delete(key);
+        });
+        if (auto left = chromatic.violations()) {
+            std::cerr << "chromatic tree left " << left << " violations\n";
+        }
+        auto flags = std::cout.flags();
+        auto precision = std::cout.precision();
+        std::cout << std::fixed << std::setprecision(2) << std::setw(7) << threads << std::setw(18) << c
+                  << std::setw(22) << l << '\n';
+        std::cout.flags(flags);
+        std::cout.precision(precision);
+    }
+}
+
+void bench_expiry(size_t size) {
+    using Clock = std::chrono::steady_clock;
+    using ms = std::chrono::milliseconds;
+    const Clock::time_point start{};
+    const int sweeps = 10;
+    std::uniform_int_distribution<int> ttl(1, 1000);
+    std::uniform_int_distribution<std::size_t> pick(0, size - 1);
+    std::vector<Clock::time_point> deadline(size);
+    for (auto& d : deadline) {
+        d = start + ms{ttl(gen)};
+    }
+    // Between two sweeps a tenth of the keys get a new deadline, mostly later:
+    std::vector<std::vector<std::pair<std::size_t, Clock::time_point>>> refresh(sweeps);
+    for (int s = 0; s < sweeps; ++s) {
+        for (std::size_t i = 0; i < size / 10; ++i) {
+            refresh[s].emplace_back(pick(gen), start + ms{100 * s + 500 + ttl(gen) / 2});
+        }
+    }
+
+    // Scan the due keys, then Delete them one at a time:
+    RBTree<std::pair<Clock::time_point, std::size_t>> queue;
+    std::unordered_map<std::size_t, Clock::time_point> current;
+    for (std::size_t k = 0; k < size; ++k) {
+        queue.insert({deadline[k], k});
+        current[k] = deadline[k];
+    }
+    std::size_t expired1 = 0;
+    auto t1 = std::chrono::steady_clock::now();
+    for (int s = 0; s < sweeps; ++s) {
+        for (const auto& [k, at] : refresh[s]) {
+            auto it = current.find(k);
+            if (it != current.end()) {
+                queue.Delete({it->second, k});
+                queue.insert({at, k});
+                it->second = at;
             }
         }
+        const auto t = start + ms{100 * (s + 1)};
+        std::vector<std::pair<Clock::time_point, std::size_t>> due;
+        for (auto it = queue.begin(); it != queue.end() && (*it).first < t; ++it) {
+            due.push_back(*it);
+        }
+        for (const auto& e : due) {
+            queue.Delete(e);
+            current.erase(e.second);
+        }
+        expired1 += due.size();
     }
-    root->color = Color::black;
-};
+    auto t2 = std::chrono::steady_clock::now();
+
+    Expiry_index<std::size_t> index;
+    for (std::size_t k = 0; k < size; ++k) {
+        index.set(k, deadline[k]);
+    }
+    std::vector<Expiry_index<std::size_t>::Sweep> report;
+    auto t3 = std::chrono::steady_clock::now();
+    for (int s = 0; s < sweeps; ++s) {
+        for (const auto& [k, at] : refresh[s]) {
+            if (index.contains(k)) {
+                index.set(k, at);
+            }
+        }
+        report.push_back(index.expire_before(start + ms{100 * (s + 1)}));
+    }
+    auto t4 = std::chrono::steady_clock::now();
 
-template <typename T, typename CMP>
-Node<T>* RBTree<T,CMP>::transplant(Node<T>* x, std::unique_ptr<Node<T>>&& y){
-    if (y) {
-        y->parent = x->parent;
-    }
-    Node<T>* w = nullptr;
-    if (!x->parent) {
-        w = root.release();
-        root = std::move(y);
-    } else if (x == x->parent->left.get()) {
-        w = x->parent->left.release();
-        x->parent->left = std::move(y);
-    } else {
-        w = x->parent->right.release();
-        x->parent->right = std::move(y);
-    }
-    return w;
+    std::size_t expired2 = 0;
+    for (const auto& r : report) {
+        expired2 += r.expired;
+    }
+    if (expired1 != expired2 || index.size() != current.size()) {
+        std::cerr << "expiry index disagrees with per-key deletes\n";
+    }
+    std::cout << "\nExpiring " << expired1 << " of " << size << " keys in " << sweeps << " sweeps:\n";
+    std::cout << "scan and Delete per key   : " << std::chrono::duration<double, std::milli>(t2 - t1).count() << " ms\n";
+    std::cout << "Expiry_index              : " << std::chrono::duration<double, std::milli>(t4 - t3).count() << " ms\n";
+    std::cout << "sweep   expired  requeued  sweep ms\n";
+    auto flags = std::cout.flags();
+    auto precision = std::cout.precision();
+    for (std::size_t s = 0; s < report.size(); ++s) {
+        std::cout << std::fixed << std::setprecision(2) << std::setw(5) << s + 1 << std::setw(10) << report[s].expired
+                  << std::setw(10) << report[s].requeued << std::setw(10) << report[s].ms << '\n';
+    }
+    std::cout.flags(flags);
+    std::cout.precision(precision);
 }
 
-template <typename T, typename CMP>
-bool RBTree<T,CMP>::Delete(Node<T>* z){
-    if (!z) {
-        return false;
-    }
-    Color orig_color = z->color;
-    Node<T>* x = nullptr;
-    Node<T>* xp = nullptr;
-    if (!z->left) {
-        x = z->right.get();
-        xp = z->parent;
-        delete transplant(z, std::move(z->right));
-    } else if (!z->right) {
-        x = z->left.get();
-        xp = z->parent;
-        auto pz = transplant(z, std::move(z->left));
-        auto upz = std::unique_ptr<Node<T>>(pz);
-    } else {
-        auto y = minimum_in_subtree(z->right.get());
-        orig_color = y->color;
-        x = y->right.get();
-        xp = y;
-        if (y->parent == z) {
-            if (x) {
-                x->parent = y;
-            }
-            auto pz = transplant(z, std::move(z->right));
-            y->left = std::move(pz->left);
-            y->left->parent = y;
-            y->color = pz->color;
-            auto upz = std::unique_ptr<Node<T>>(pz);
-        } else {
-            xp = y->parent;
-            auto py = transplant(y, std::move(y->right));
-            py->right = std::move(z->right);
-            py->right->parent = py;
-            auto upy = std::unique_ptr<Node<T>>(py);
-            auto pz = transplant(z, std::move(upy));
-            py->left = std::move(pz->left);
-            py->left->parent = py;
-            py->color = pz->color;
-            auto upz = std::unique_ptr<Node<T>>(pz);
-        }
-    }
-    if (orig_color == Color::black) {
-        delete_fixup(x, xp);
-    }
-    return true;
+void bench_hash_index(const std::vector<int>& v) {
+    RBTree<int> tree;
+    Hashed_RBTree<int> hashed;
+    auto ins1 = time_inserts(tree, v);
+    auto ins2 = time_inserts(hashed, v);
+    auto look1 = time_lookups(tree, v);
+    auto look2 = time_lookups(hashed, v);
+    const std::size_t nodes = v.size() * sizeof(Node<int>);
+    std::size_t in_order = 0;
+    for (int key : hashed) {
+        in_order += key == static_cast<int>(in_order + 1);
+    }
+    if (in_order != v.size()) {
+        std::cerr << "hashed tree iterates out of order\n";
+    }
+    auto del1 = time_deletes(tree, v);
+    auto del2 = time_deletes(hashed, v);
+
+    std::cout << "\nHash index over " << v.size() << " keys:\n";
+    std::cout << "tree insert               : " << ins1 << " ms\n";
+    std::cout << "hashed tree insert        : " << ins2 << " ms\n";
+    std::cout << "tree contains             : " << look1 << " ms\n";
+    std::cout << "hashed tree contains      : " << look2 << " ms (" << look1 / look2 << "x)\n";
+    std::cout << "tree Delete               : " << del1 << " ms\n";
+    std::cout << "hashed tree Delete        : " << del2 << " ms\n";
+    std::cout << "nodes                     : " << nodes / 1024 << " KiB\n";
+    std::cout << "hash index                : " << hashed.index_bytes() / 1024 << " KiB ("
+              << static_cast<double>(hashed.index_bytes()) / v.size() << " bytes per key)\n";
+
+    // Under a case-insensitive order, the index finds a key in any case and
+    // refuses it in another case, as the tree does:
+    Hashed_RBTree<std::string, Case_less> names;
+    std::size_t refused = 0, found = 0;
+    for (std::size_t i = 0; i < v.size(); ++i) {
+        names.insert("Key" + std::to_string(i));
+        refused += !names.insert("KEY" + std::to_string(i));
+    }
+    for (std::size_t i = 0; i < v.size(); ++i) {
+        found += names.contains("kEY" + std::to_string(i));
+    }
+    if (refused != v.size() || found != v.size() || names.size() != names.tree().size()) {
+        std::cerr << "hash index disagrees with a case-insensitive tree\n";
+    }
+    std::cout << "case-insensitive keys     : " << found << " of " << v.size() << " found in another case\n";
 }
 
-template <typename T, typename CMP>
-void RBTree<T,CMP>::delete_fixup(Node<T>* x, Node<T>* xp){
-    while (x != root.get() && (!x || x->color == Color::black)) {
-        if (x == xp->left.get()) {
-            Node<T>* w = xp->right.get();
-            if (w && w->color == Color::red) {
-                w->color = Color::black;
-                xp->color = Color::red;
-                auto xpp = xp->parent;
-                if (!xpp) {
-                    rotate_left(std::move(root));
-                } else if (xp == xpp->left.get()) {
-                    rotate_left(std::move(xpp->left));
-                } else {
-                    rotate_left(std::move(xpp->right));
-                }
-                w = xp->right.get();
-            }
-            if (w && (!w->left || w->left->color == Color::black)
-                && (!w->right || w->right->color == Color::black)) {
-                w->color = Color::red;
-                x = xp;
-                xp = xp->parent;
-            } else if (w) {
-                if (!w->right || w->right->color == Color::black) {
-                    w->left->color = Color::black;
-                    w->color = Color::red;
-                    auto wp = w->parent;
-                    if (!wp) {
-                        rotate_right(std::move(root));
-                    } else if (w == wp->left.get()) {
-                        rotate_right(std::move(wp->left));
-                    } else {
-                        rotate_right(std::move(wp->right));
-                    }
-                    w = xp->right.get();
-                }
-                w->color = xp->color;
-                xp->color = Color::black;
-                w->right->color = Color::black;
-                auto xpp = xp->parent;
-                if (!xpp) {
-                    rotate_left(std::move(root));
-                } else if (xp == xpp->left.get()) {
-                    rotate_left(std::move(xpp->left));
-                } else {
-                    rotate_left(std::move(xpp->right));
-                }
-                x = root.get();
-            } else {
-                x = root.get();
+void bench_compact(const std::vector<int>& v) {
+    // Churn: every other key is deleted and inserted again, so the nodes end
+    // up far from their neighbours in the tree.
+    RBTree<int> tree;
+    time_inserts(tree, v);
+    for (int round = 0; round < 2; ++round) {
+        for (std::size_t i = round; i < v.size(); i += 2) {
+            tree.Delete(v[i]);
+        }
+        for (std::size_t i = round; i < v.size(); i += 2) {
+            tree.insert(v[i]);
+        }
+    }
+    auto print = [](const char* name, const Memory_usage& m, double lookups) {
+        auto flags = std::cout.flags();
+        auto precision = std::cout.precision();
+        std::cout << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(12) << static_cast<double>(m.allocated) / m.nodes
+                  << std::setw(11) << static_cast<double>(m.slack) / m.nodes
+                  << std::setw(8) << m.pages << std::setw(8) << m.fragmentation
+                  << std::setw(13) << lookups << '\n';
+        std::cout.flags(flags);
+        std::cout.precision(precision);
+    };
+    std::cout << "\nNode memory of " << v.size() << " keys (" << sizeof(Node<int>) << " bytes per node):\n";
+    std::cout << "layout    bytes/node  slack/node   pages  fragm.  contains ms\n";
+    print("heap", tree.memory_usage(), time_lookups(tree, v));
+    tree.compact(Node_order::in_order);
+    print("in-order", tree.memory_usage(), time_lookups(tree, v));
+    tree.compact(Node_order::van_emde_boas);
+    print("vEB", tree.memory_usage(), time_lookups(tree, v));
+}
+
+void bench_latency(const std::vector<int>& v) {
+    RBTree<int> plain;
+    RBTree<int> recorded;
+    Latency_log log;
+    recorded.record_latencies(&log);
+    auto ins1 = time_inserts(plain, v);
+    auto ins2 = time_inserts(recorded, v);
+    auto look1 = time_lookups(plain, v);
+    auto look2 = time_lookups(recorded, v);
+    auto del1 = time_deletes(plain, v);
+    auto del2 = time_deletes(recorded, v);
+    std::cout << "\nLatency of " << v.size() << " operations of each kind:\n";
+    log.report(std::cout);
+    std::cout << "recording overhead        : " << ins2 + look2 + del2 - ins1 - look1 - del1 << " ms over "
+              << ins1 + look1 + del1 << " ms\n";
+}
+
+void bench_node_handles(const std::vector<int>& v) {
+    auto ms = [](auto t1, auto t2) { return std::chrono::duration<double, std::milli>(t2 - t1).count(); };
+    const std::size_t half = v.size() / 2;
+    auto by_delete = [&](RBTree<int>& from, RBTree<int>& to) {
+        auto t1 = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < half; ++i) {
+            from.Delete(v[i]);
+            to.insert(v[i]);
+        }
+        return ms(t1, std::chrono::steady_clock::now());
+    };
+    auto by_extract = [&](RBTree<int>& from, RBTree<int>& to) {
+        auto t1 = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < half; ++i) {
+            to.insert(from.extract(v[i]));
+        }
+        return ms(t1, std::chrono::steady_clock::now());
+    };
+    auto by_key = [&](RBTree<int>& tree) {
+        auto t1 = std::chrono::steady_clock::now();
+        bool odd = false;
+        for (auto it = tree.begin(); it != tree.end();) {
+            int key = *it;
+            ++it;
+            if ((odd = !odd)) {
+                tree.Delete(key);
             }
+        }
+        return ms(t1, std::chrono::steady_clock::now());
+    };
+    auto by_iterator = [&](RBTree<int>& tree) {
+        auto t1 = std::chrono::steady_clock::now();
+        bool odd = false;
+        for (auto it = tree.begin(); it != tree.end();) {
+            it = (odd = !odd) ? tree.erase(it) : std::next(it);
+        }
+        return ms(t1, std::chrono::steady_clock::now());
+    };
+
+    // Whichever variant runs first pays for a cold cache and heap, which at
+    // this size outweighs the difference between them, so each round uses
+    // fresh trees, the order flips from one round to the next and the best
+    // round of each is reported:
+    double moved[2] = {1e300, 1e300}, merged = 1e300, erased[2] = {1e300, 1e300};
+    for (int round = 0; round < 6; ++round) {
+        RBTree<int> a1, b1, a2, b2, a3, b3;
+        time_inserts(a1, v);
+        time_inserts(a2, v);
+        time_inserts(a3, v);
+        for (std::size_t i = half; i < v.size(); ++i) {
+            b3.insert(v[i]);
+        }
+        const bool flip = round % 2;
+        if (flip) {
+            moved[1] = std::min(moved[1], by_extract(a2, b2));
+            moved[0] = std::min(moved[0], by_delete(a1, b1));
         } else {
-            Node<T>* w = xp->left.get();
-            if (w && w->color == Color::red) {
-                w->color = Color::black;
-                xp->color = Color::red;
-                auto xpp = xp->parent;
-                if (!xpp) {
-                    rotate_right(std::move(root));
-                } else if (xp == xpp->left.get()) {
-                    rotate_right(std::move(xpp->left));
-                } else {
-                    rotate_right(std::move(xpp->right));
-                }
-                w = xp->left.get();
+            moved[0] = std::min(moved[0], by_delete(a1, b1));
+            moved[1] = std::min(moved[1], by_extract(a2, b2));
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        b3.merge(a3);
+        merged = std::min(merged, ms(t1, std::chrono::steady_clock::now()));
+        if (a1.size() != a2.size() || b1.size() != b2.size() || a3.size() != half || b3.size() != v.size()) {
+            std::cerr << "node handles disagree with Delete and insert\n";
+        }
+
+        // Delete every other key during a scan:
+        if (flip) {
+            erased[1] = std::min(erased[1], by_iterator(a2));
+            erased[0] = std::min(erased[0], by_key(a1));
+        } else {
+            erased[0] = std::min(erased[0], by_key(a1));
+            erased[1] = std::min(erased[1], by_iterator(a2));
+        }
+        if (a1.size() != a2.size()) {
+            std::cerr << "erase(iterator) disagrees with Delete\n";
+        }
+    }
+
+    std::cout << "\nMoving " << half << " keys to another tree (best of 6):\n";
+    std::cout << "Delete and insert         : " << moved[0] << " ms\n";
+    std::cout << "extract and insert(node)  : " << moved[1] << " ms\n";
+    std::cout << "merge                     : " << merged << " ms\n";
+    std::cout << "Deleting every other key during a scan:\n";
+    std::cout << "Delete(key)               : " << erased[0] << " ms\n";
+    std::cout << "erase(iterator)           : " << erased[1] << " ms\n";
+}
+
+void bench_bloom(const std::vector<int>& v) {
+    // The tree holds the even keys; nine lookups in ten ask for an odd one,
+    // so misses end anywhere in the tree rather than on its right spine:
+    const int n = static_cast<int>(v.size());
+    std::vector<int> evens(v.size()), queries(v.size());
+    for (std::size_t i = 0; i < v.size(); ++i) {
+        evens[i] = 2 * v[i];
+        queries[i] = i % 10 ? 2 * v[i] + 1 : 2 * v[i];
+    }
+    RBTree<int> tree;
+    time_inserts(tree, evens);
+
+    std::cout << "\n" << queries.size() << " lookups, 90% of them for absent keys:\n";
+    std::cout << "bits/key       KiB   false pos  contains ms\n";
+    for (double bits : {0.0, 4.0, 8.0, 12.0, 16.0}) {
+        tree.enable_bloom_filter(bits);
+        std::size_t passed = 0, absent = 0, found = 0;
+        for (int key : queries) {
+            if (key % 2) {
+                ++absent;
+                passed += tree.may_contain(key);
             }
-            if (w && (!w->left || w->left->color == Color::black)
-                && (!w->right || w->right->color == Color::black)) {
-                w->color = Color::red;
-                x = xp;
-                xp = xp->parent;
-            } else if (w) {
-                if (!w->left || w->left->color == Color::black) {
-                    w->right->color = Color::black;
-                    w->color = Color::red;
-                    auto wp = w->parent;
-                    if (!wp) {
-                        rotate_left(std::move(root));
-                    } else if (w == wp->left.get()) {
-                        rotate_left(std::move(wp->left));
-                    } else {
-                        rotate_left(std::move(wp->right));
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        for (int key : queries) {
+            found += tree.contains(key);
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        if (found != queries.size() - absent) {
+            std::cerr << "Bloom filter hid " << queries.size() - absent - found << " keys\n";
+        }
+        auto flags = std::cout.flags();
+        auto precision = std::cout.precision();
+        std::cout << std::fixed << std::setprecision(0) << std::setw(8) << bits << std::setw(10)
+                  << tree.bloom_bytes() / 1024.0 << std::setprecision(2) << std::setw(11)
+                  << 100.0 * passed / absent << '%' << std::setw(13)
+                  << std::chrono::duration<double, std::milli>(t2 - t1).count() << '\n';
+        std::cout.flags(flags);
+        std::cout.precision(precision);
+    }
+
+    // Deleted keys keep their bits until enough of them force a rebuild:
+    tree.enable_bloom_filter(10);
+    for (int i = 0; i < n; i += 2) {
+        tree.Delete(evens[i]);
+    }
+    std::size_t stale = 0;
+    for (int i = 0; i < n; i += 2) {
+        stale += tree.may_contain(evens[i]);
+    }
+    std::cout << "after deleting half       : " << 100.0 * stale / ((v.size() + 1) / 2)
+              << "% of deleted keys still pass\n";
+
+    // Under a case-insensitive order, keys are found in any case only
+    // because the filter hashes them with the case-folding Order_hash:
+    RBTree<std::string, Case_less> names;
+    names.enable_bloom_filter(10);
+    for (int i = 0; i < n; ++i) {
+        names.insert("Key" + std::to_string(i));
+    }
+    std::size_t hidden = 0;
+    for (int i = 0; i < n; ++i) {
+        hidden += !names.contains("KEY" + std::to_string(i));
+    }
+    if (hidden) {
+        std::cerr << "Bloom filter hid " << hidden << " keys of another case\n";
+    }
+    std::cout << "case-insensitive keys     : " << n - hidden << " of " << n << " found in upper case\n";
+}
+
+void bench_replicas(const std::vector<int>& v) {
+    // One reader per node, each looking every key up; in the mixed runs one
+    // lookup in a hundred also inserts and deletes a key nobody looks for:
+    const auto topology = Numa_topology::simulated(2);
+    auto run = [&](int write_every, auto&& contains, auto&& write) {
+        std::vector<std::thread> readers;
+        auto t1 = std::chrono::steady_clock::now();
+        for (unsigned node = 0; node < topology.nodes(); ++node) {
+            readers.emplace_back([&, node] {
+                topology.pin_to(node);
+                std::size_t found = 0;
+                for (std::size_t i = node; i < v.size() + node; ++i) {
+                    int key = v[i % v.size()];
+                    if (write_every && i % write_every == 0) {
+                        write(-key);
                     }
-                    w = xp->left.get();
+                    found += contains(key);
                 }
-                w->color = xp->color;
-                xp->color = Color::black;
-                w->left->color = Color::black;
-                auto xpp = xp->parent;
-                if (!xpp) {
-                    rotate_right(std::move(root));
-                } else if (xp == xpp->left.get()) {
-                    rotate_right(std::move(xpp->left));
-                } else {
-                    rotate_right(std::move(xpp->right));
+                if (found != v.size()) {
+                    std::cerr << "readers missed " << v.size() - found << " keys\n";
                 }
-                x = root.get();
-            } else {
-                x = root.get();
-            }
+            });
+        }
+        for (auto& r : readers) {
+            r.join();
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::milli>(t2 - t1).count();
+    };
+
+    std::cout << "\n" << topology.nodes() << " simulated NUMA nodes (" << Numa_topology::detect().nodes()
+              << " real), a reader on each looking up " << v.size() << " keys:\n";
+    for (int write_every : {0, 100}) {
+        RBTree<int> locked;
+        std::shared_mutex m;
+        Replicated_RBTree<int> replicated{topology};
+        for (int key : v) {
+            locked.insert(key);
+            replicated.insert(key, 0);
         }
+        auto l = run(write_every, [&](int key) {
+            std::shared_lock<std::shared_mutex> lk{m};
+            return locked.contains(key);
+        }, [&](int key) {
+            std::unique_lock<std::shared_mutex> lk{m};
+            locked.insert(key);
+            locked.Delete(key);
+        });
+        auto r = run(write_every, [&](int key) { return replicated.contains(key); }, [&](int key) {
+            replicated.insert(key);
+            replicated.Delete(key);
+        });
+        std::cout << (write_every ? "1% writes:\n" : "reads only:\n");
+        std::cout << "locked RBTree             : " << l << " ms\n";
+        std::cout << "replica per node          : " << r << " ms (log of " << replicated.log_size()
+                  << " entries left)\n";
     }
-    if (x) {
-        x->color = Color::black;
+}
+
+void bench_radix(const std::vector<int>& v) {
+    // Multiplying by an odd constant spreads the keys over all 32 bits
+    // without repeating any:
+    std::vector<std::uint32_t> keys(v.size());
+    for (std::size_t i = 0; i < v.size(); ++i) {
+        keys[i] = static_cast<std::uint32_t>(v[i]) * 0x9E3779B1u;
     }
-}    
+    auto iterate = [](const auto& tree) {
+        std::uint64_t sum = 0;
+        auto t1 = std::chrono::steady_clock::now();
+        for (auto key : tree) {
+            sum += key;
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        if (sum == 1) {
+            std::cerr << "unlikely sum\n";
+        }
+        return std::chrono::duration<double, std::milli>(t2 - t1).count();
+    };
+    auto print = [](const char* name, double ins, double look, double walk, double depth) {
+        auto flags = std::cout.flags();
+        auto precision = std::cout.precision();
+        std::cout << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(11) << ins << std::setw(13) << look << std::setw(13) << walk << std::setw(9)
+                  << depth << '\n';
+        std::cout.flags(flags);
+        std::cout.precision(precision);
+    };
+    // Average depth inside the buckets, weighted by their keys:
+    auto bucket_depth = [](const auto& tree) {
+        double total = 0;
+        for (std::size_t b = 0; b < tree.bucket_count; ++b) {
+            total += tree.bucket(b).average_depth() * static_cast<double>(tree.bucket(b).size());
+        }
+        return total / static_cast<double>(tree.size());
+    };
 
+    std::cout << "\n" << keys.size() << " uint32 keys spread over the key space:\n";
+    std::cout << "directory   insert ms  contains ms  iterate ms    depth\n";
+    {
+        RBTree<std::uint32_t> tree;
+        auto ins = time_inserts(tree, keys);
+        print("none", ins, time_lookups(tree, keys), iterate(tree), tree.average_depth());
+    }
+    {
+        Radix_RBTree<std::uint32_t, 8> tree;
+        auto ins = time_inserts(tree, keys);
+        print("2^8", ins, time_lookups(tree, keys), iterate(tree), bucket_depth(tree));
+    }
+    {
+        Radix_RBTree<std::uint32_t, 12> tree;
+        auto ins = time_inserts(tree, keys);
+        print("2^12", ins, time_lookups(tree, keys), iterate(tree), bucket_depth(tree));
+    }
+}
 
-// USEFUL FUNCTIONS TO PRINT RBTree:
-template <typename T>
-std::ostream& operator<<(std::ostream& os, Node<T>* node) {
-    if (node) {
-        os << node->left.get();
-        os << node->key;
-        if (node->color == Color::black) {
-            os << "● ";
-        } else {
-            os << "○ ";
+void bench_write_buffer(const std::vector<int>& keys) {
+    const std::vector<int> v = at_least(keys, 1 << 20);
+    std::cout << "\nInserting " << v.size() << " keys in random order:\n";
+    std::cout << "buffer      insert ms  contains ms\n";
+    auto print = [](std::size_t capacity, double ins, double look) {
+        auto flags = std::cout.flags();
+        auto precision = std::cout.precision();
+        std::cout << std::setw(6) << capacity << std::fixed << std::setprecision(2) << std::setw(15) << ins
+                  << std::setw(13) << look << '\n';
+        std::cout.flags(flags);
+        std::cout.precision(precision);
+    };
+    // Looked up in another order than inserted, so that the nodes allocated
+    // in insertion order get no head start:
+    std::vector<int> lookups(v);
+    std::shuffle(lookups.begin(), lookups.end(), gen);
+    {
+        RBTree<int> tree;
+        auto ins = time_inserts(tree, v);
+        print(0, ins, time_lookups(tree, lookups));
+    }
+    for (std::size_t capacity : {256, 4096, 65536}) {
+        Buffered_RBTree<int> tree{capacity};
+        auto t1 = std::chrono::steady_clock::now();
+        for (int key : v) {
+            tree.insert(key);
         }
-        os << node->right.get();
+        tree.flush();
+        auto t2 = std::chrono::steady_clock::now();
+        print(capacity, std::chrono::duration<double, std::milli>(t2 - t1).count(), time_lookups(tree, lookups));
     }
-    return os;
 }
 
-template <typename T, typename CMP>
-std::ostream& operator<<(std::ostream& os, const RBTree<T,CMP>& tree) {
-    os << tree.root.get();
-    return os;
+// One of the in-flight lookup loops of bench_async_find: keys first,
+// first + step, ... of keys.
+Task<> find_every(const RBTree<int>& tree, const std::vector<int>& keys, std::size_t first, std::size_t step,
+                  std::size_t& found) {
+    for (std::size_t i = first; i < keys.size(); i += step) {
+        found += co_await tree.async_find(keys[i]) != tree.end();
+    }
 }
 
+void bench_async_find(const std::vector<int>& keys) {
+    // Prefetching only pays off once lookups miss the cache: the tree takes
+    // at least four times the last level cache (32 MiB if unknown), and 1M
+    // of its keys, drawn at random, are looked up. A tree grown for this is
+    // filled in ascending order, which is quick, while the lookups still
+    // land anywhere in it.
+    std::size_t llc = 0;
+    std::ifstream{"/sys/devices/system/cpu/cpu0/cache/index3/size"} >> llc; // in KiB
+    const std::size_t min_keys = 4 * (llc ? llc : 32 * 1024) * 1024 / (sizeof(Node<int>) + 16);
+    std::vector<int> v(keys);
+    if (v.size() < min_keys) {
+        v.resize(min_keys);
+        std::iota(v.begin(), v.end(), 1);
+    }
+    RBTree<int> tree;
+    time_inserts(tree, v);
+    std::uniform_int_distribution<std::size_t> pick(0, v.size() - 1);
+    std::vector<int> lookups(std::min<std::size_t>(v.size(), 1 << 20));
+    for (int& key : lookups) {
+        key = v[pick(gen)];
+    }
+    const auto used = tree.memory_usage();
 
-// RBTree ITERATOR:
-template <typename RBTree, typename T>
-const_iterator<RBTree,T>& const_iterator<RBTree,T>::operator++() {  // pre-increment ++i
-  current = current->right.get();
-  return *this;
-}
-
-template <typename RBTree, typename T>
-const_iterator<RBTree,T> const_iterator<RBTree,T>::operator++(int) {  // post-increment i++
-  auto tmp = *this;
-  ++(*this); // i++ is slower than ++i since it first return the copy and then increment it!
-  return tmp;
+    std::cout << "\n" << lookups.size() << " lookups in " << used.allocated / 1024 << " KiB of nodes (last level cache: "
+              << llc << " KiB):\n";
+    const double sync = time_lookups(tree, lookups);
+    std::cout << "contains loop             : " << sync << " ms\n";
+    for (std::size_t in_flight : {1, 8, 32, 128, 512}) {
+        std::size_t found = 0;
+        Lookup_scheduler scheduler;
+        auto t1 = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < in_flight; ++i) {
+            scheduler.spawn(find_every(tree, lookups, i, in_flight, found));
+        }
+        scheduler.run();
+        auto t2 = std::chrono::steady_clock::now();
+        if (found != lookups.size()) {
+            std::cerr << "async_find missed " << lookups.size() - found << " keys\n";
+        }
+        const double ms = std::chrono::duration<double, std::milli>(t2 - t1).count();
+        std::cout << "async_find, " << std::setw(3) << in_flight << " in flight  : " << ms << " ms ("
+                  << sync / ms << "x)\n";
+    }
 }
-
@@ -0,0 +1,4142 @@
+#ifndef RBTREE_HPP
+#define RBTREE_HPP
+
+#include <memory> // for std::unique_ptr
+#include <array>
+#include <string_view>
+#include <functional> // for std::less
+#include <string>
+#include <iostream>
+#include <cassert>
+#include <utility>
+#include <numeric>
+#include <vector>
+#include <random>
+#include <set>
+#include <queue>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <type_traits>
+#include <cmath>
+#include <charconv>
+#include <cstdio>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <new>
+#include <bit>
+#include <concepts>
+#include <coroutine>
+#include <optional>
+#include <limits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // for __rdtsc
+#endif
+#include <unordered_map>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#ifdef __linux__
+#include <malloc.h> // for malloc_usable_size
+#endif
+
+
+enum class Color : bool {black, red};
+enum class side : bool {left, right};
+inline side get_reverse_side(const side s) { return s == side::right? side::left : side::right; };
+
+struct Multi_insert {
+    std::string message;
+    Multi_insert(std::string s) : message{std::move(s)} {}
+    const char* what() const { return message.c_str(); }
+};
+
+// Text of a key for error messages:
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value, std::string>::type key_to_string(const T& key) {
+    return std::to_string(key);
+}
+template <typename T>
+typename std::enable_if<!std::is_arithmetic<T>::value, std::string>::type key_to_string(const T&) {
+    return "an equal key";
+}
+inline std::string key_to_string(const std::string& key) { return key; }
+
+// Formats of RBTree::export_to:
+//   keys  one key per line, in order (tombstones skipped), with backslashes,
+//         newlines and carriage returns in keys written as \\, \n and \r;
+//   dot   Graphviz digraph of the structure, red nodes in red;
+//   json  nested {"key", "color", "left", "right"} objects.
+enum class Export_format {keys, dot, json};
+
+// Output buffer of the exporters: text is formatted into a large chunk
+// that is handed to the sink only when full, so a dump costs few writes.
+class Export_buffer {
+    std::function<void(const char*, std::size_t)> sink;
+    std::vector<char> chunk;
+    std::size_t used = 0;
+
+    void reserve(std::size_t n) {
+        if (chunk.size() - used < n) {
+            flush();
+        }
+    }
+
+    public:
+    static constexpr std::size_t chunk_size = 1 << 16;
+    explicit Export_buffer(std::function<void(const char*, std::size_t)> s) : sink{std::move(s)}, chunk(chunk_size) {}
+
+    void flush() {
+        if (used) {
+            sink(chunk.data(), used);
+            used = 0;
+        }
+    }
+    void put(char c) {
+        reserve(1);
+        chunk[used++] = c;
+    }
+    void put(const char* s, std::size_t n) {
+        if (n > chunk.size()) {
+            flush();
+            sink(s, n);
+            return;
+        }
+        reserve(n);
+        std::memcpy(chunk.data() + used, s, n);
+        used += n;
+    }
+    void put(const char* s) { put(s, std::strlen(s)); }
+    template <typename N>
+    void put_number(N value) {
+        reserve(64);
+        auto r = std::to_chars(chunk.data() + used, chunk.data() + chunk.size(), value);
+        used = static_cast<std::size_t>(r.ptr - chunk.data());
+    }
+};
+
+// How export_key writes a key: as is, as one line of the keys format, or
+// as a DOT or JSON string literal (numbers need none of them, except NaN
+// and the infinities, which neither format can write bare):
+enum class Key_escape {none, line, dot, json};
+
+// Text of a key for the exporters:
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value>::type export_key(Export_buffer& out, const T& key, Key_escape escape) {
+    if constexpr (std::is_floating_point<T>::value) {
+        if (!std::isfinite(key) && (escape == Key_escape::dot || escape == Key_escape::json)) {
+            out.put('"');
+            out.put_number(key); // nan, inf or -inf
+            out.put('"');
+            return;
+        }
+    }
+    out.put_number(+key); // promotes bool and chars, which to_chars does not take
+}
+inline void export_key(Export_buffer& out, const std::string& key, Key_escape escape) {
+    switch (escape) {
+    case Key_escape::none:
+        out.put(key.data(), key.size());
+        return;
+    case Key_escape::line:
+        for (char c : key) {
+            if (c == '\\' || c == '\n' || c == '\r') {
+                out.put('\\');
+                out.put(c == '\n' ? 'n' : c == '\r' ? 'r' : c);
+            } else {
+                out.put(c);
+            }
+        }
+        return;
+    case Key_escape::dot:
+        // Graphviz has no \u escapes: a newline becomes a label line
+        // break, a tab a space, and other control characters are dropped
+        out.put('"');
+        for (char c : key) {
+            if (c == '"' || c == '\\') {
+                out.put('\\');
+                out.put(c);
+            } else if (c == '\n') {
+                out.put("\\n");
+            } else if (c == '\t') {
+                out.put(' ');
+            } else if (static_cast<unsigned char>(c) >= 0x20) {
+                out.put(c);
+            }
+        }
+        out.put('"');
+        return;
+    case Key_escape::json:
+        out.put('"');
+        for (char c : key) {
+            if (c == '"' || c == '\\') {
+                out.put('\\');
+                out.put(c);
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char esc[8];
+                std::snprintf(esc, sizeof esc, "\\u%04x", static_cast<unsigned>(static_cast<unsigned char>(c)));
+                out.put(esc);
+            } else {
+                out.put(c);
+            }
+        }
+        out.put('"');
+        return;
+    }
+}
+template <typename T>
+typename std::enable_if<!std::is_arithmetic<T>::value>::type export_key(Export_buffer& out, const T& key, Key_escape escape) {
+    std::ostringstream os;
+    os << key;
+    export_key(out, os.str(), escape);
+}
+
+// Node orders of RBTree::compact:
+//   in_order       nodes by key, as a scan visits them;
+//   van_emde_boas  recursive layout of the top half of the levels followed by
+//                  each bottom subtree, so a search touches O(log_B n) blocks.
+enum class Node_order {in_order, van_emde_boas};
+
+// Footprint of the nodes of an RBTree (the heap memory keys may own is not counted):
+struct Memory_usage {
+    std::size_t nodes = 0;       // tombstones included
+    std::size_t node_bytes = 0;  // sizeof of a node
+    std::size_t allocated = 0;   // bytes taken from the allocator for them
+    std::size_t slack = 0;       // allocated minus nodes * node_bytes
+    std::size_t pages = 0;       // 4 KiB pages holding at least one node
+    double fragmentation = 0;    // 1 - (pages the nodes would fill packed) / pages
+};
+
+// HDR-style histogram of latencies in nanoseconds: values below 16 have a
+// bucket each, larger ones 16 buckets per power of two, so any value is
+// known within 1/16 with a fixed 8 KiB table.
+class Latency_histogram {
+    static constexpr int sub_bits = 4;
+    std::array<std::uint64_t, 64 << sub_bits> counts{};
+    std::uint64_t total = 0;
+    std::uint64_t largest = 0;
+
+    static std::size_t bucket(std::uint64_t ns) {
+        if (ns < (1u << sub_bits)) {
+            return static_cast<std::size_t>(ns);
+        }
+        const int e = std::bit_width(ns) - 1 - sub_bits;
+        return (static_cast<std::size_t>(e + 1) << sub_bits) + static_cast<std::size_t>((ns >> e) - (1u << sub_bits));
+    }
+    // Largest value falling in bucket i:
+    static std::uint64_t upper(std::size_t i) {
+        if (i < (1u << sub_bits)) {
+            return i;
+        }
+        const int e = static_cast<int>(i >> sub_bits) - 1;
+        return (((i & ((1u << sub_bits) - 1)) + (1u << sub_bits) + 1) << e) - 1;
+    }
+
+    public:
+    void record(std::uint64_t ns) {
+        ++counts[bucket(ns)];
+        ++total;
+        largest = std::max(largest, ns);
+    }
+    // Add the samples of other, e.g. one histogram per thread:
+    void merge(const Latency_histogram& other) {
+        for (std::size_t i = 0; i < counts.size(); ++i) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        largest = std::max(largest, other.largest);
+    }
+    std::uint64_t count() const { return total; }
+    std::uint64_t max() const { return largest; }
+    // Upper bound of the bucket holding the p-th percentile (0 < p <= 100):
+    std::uint64_t percentile(double p) const {
+        const auto rank = static_cast<std::uint64_t>(std::ceil(p / 100 * static_cast<double>(total)));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank && seen) {
+                return std::min(upper(i), largest);
+            }
+        }
+        return largest;
+    }
+};
+
+// Phases timed by the latency recording mode of RBTree:
+enum class Phase {
+    insert, insert_alloc, insert_link, insert_fixup,
+    Delete, delete_search, delete_unlink, delete_fixup, delete_free,
+    contains
+};
+
+// One histogram per phase:
+struct Latency_log {
+    std::array<Latency_histogram, 10> phases;
+    Latency_histogram& operator[](Phase p) { return phases[static_cast<std::size_t>(p)]; }
+    const Latency_histogram& operator[](Phase p) const { return phases[static_cast<std::size_t>(p)]; }
+    // Count, p50, p90, p99, p99.9 and max of every phase recorded:
+    void report(std::ostream&) const;
+};
+
+// Clock of the latency recording mode: the time-stamp counter where there
+// is one (half the cost of steady_clock), calibrated once against steady_clock.
+struct Tick_clock {
+    static std::uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+    // Nanoseconds per tick, measured over 10 ms on the first call:
+    static double ns_per_tick();
+};
+
+// Times consecutive phases of one operation into a log; does nothing
+// (not even reading the clock) when the log is null.
+class Phase_clock {
+    Latency_log* log;
+    std::uint64_t start = 0;
+    std::uint64_t last = 0;
+
+    static std::uint64_t ns(std::uint64_t ticks) {
+        return static_cast<std::uint64_t>(static_cast<double>(ticks) * Tick_clock::ns_per_tick());
+    }
+
+    public:
+    explicit Phase_clock(Latency_log* log) : log{log} {
+        if (log) {
+            start = last = Tick_clock::now();
+        }
+    }
+    // Record the time since the previous lap:
+    void lap(Phase p) {
+        if (log) {
+            auto t = Tick_clock::now();
+            (*log)[p].record(ns(t - last));
+            last = t;
+        }
+    }
+    // Record the time since the clock was started:
+    void done(Phase p) {
+        if (log) {
+            (*log)[p].record(ns(Tick_clock::now() - start));
+        }
+    }
+};
+
+// Node layout policy: a fixed-width prefix of the key, kept inline in the
+// node, whose integer order agrees with std::less on the keys. A tie says
+// nothing and falls back to the full comparison. By default nodes carry no
+// prefix; specialize it to opt a key type in, before the first RBTree of
+// that type is used.
+template <typename T>
+struct Key_prefix {
+    static constexpr bool enabled = false;
+    static std::uint64_t of(const T&) { return 0; }
+};
+
+// Prefix for std::string keys, which costs 8 bytes per node. It pays off
+// when keys differ early (hashes, UUIDs) and is slower when they share a
+// long head (URLs, paths), where every compare ties. Opt in with
+//   template <> struct Key_prefix<std::string> : String_key_prefix {};
+struct String_key_prefix {
+    static constexpr bool enabled = true;
+    // First 8 bytes, big-endian and zero padded (chars compare as unsigned):
+    static std::uint64_t of(const std::string& key) {
+        std::uint64_t p = 0;
+        auto n = std::min<std::size_t>(key.size(), 8);
+        for (std::size_t i = 0; i < n; ++i) {
+            p |= std::uint64_t{static_cast<unsigned char>(key[i])} << (56 - 8 * i);
+        }
+        return p;
+    }
+};
+
+// Storage of the prefix inside Node (empty, thus free, when disabled):
+template <typename T, bool = Key_prefix<T>::enabled>
+struct Prefix_slot {
+    void set_prefix(const T&) {}
+    std::uint64_t prefix() const { return 0; }
+};
+template <typename T>
+struct Prefix_slot<T, true> {
+    std::uint64_t prefix_bits;
+    void set_prefix(const T& key) { prefix_bits = Key_prefix<T>::of(key); }
+    std::uint64_t prefix() const { return prefix_bits; }
+};
+
+template <typename T>
+struct Node_block;
+
+// Struct to represent Red-Black Tree Node
+template <typename T>
+struct Node : Prefix_slot<T> {
+    T key;
+    Color color; 
+    std::uint8_t rank; // height (AVL) or rank (WAVL); lives in the padding after color
+    bool dead; // tombstone left by a lazy Delete
+    bool pooled = false; // lives in a Node_block (of RBTree::compact or a Node_source)
+    std::unique_ptr< Node<T> > children[2]; // indexed by side: [0] left, [1] right
+    Node<T> *parent;
+
+    public:
+    // default ctor
+    Node() noexcept : color{Color::red}, rank{0}, dead{false}, parent{nullptr}{ this->set_prefix(this->key); }
+    // custom ctors
+    explicit Node(const T& key) noexcept : key{key}, color{Color::red}, rank{0}, dead{false}, parent{nullptr} {
+        this->set_prefix(this->key);
+    }
+    explicit Node(T&& key) noexcept : key{std::move(key)}, color{Color::red}, rank{0}, dead{false}, parent{nullptr} {
+        this->set_prefix(this->key);
+    }
+    // default dtor
+    ~Node() noexcept = default;
+
+    // useful methods
+    bool is_root() const { return parent == nullptr; }
+    bool is_leaf() const { return children[0] == nullptr && children[1] == nullptr; }
+    bool is_right_child() const { return !this->is_root() && parent->children[1].get() == this; }
+    side get_side() const { return is_right_child() ? side::right : side::left; }
+    std::unique_ptr< Node<T> >& child(side s) { return children[static_cast<bool>(s)]; }
+    const std::unique_ptr< Node<T> >& child(side s) const { return children[static_cast<bool>(s)]; }
+
+    // unique_ptr deletes heap and pooled nodes alike:
+    static void operator delete(Node* x, std::destroying_delete_t) {
+        const bool in_block = x->pooled;
+        x->~Node();
+        if (in_block) {
+            Node_block<T>::release(x);
+        } else {
+            ::operator delete(x);
+        }
+    }
+};
+
+// Block of nodes laid out by RBTree::compact. Blocks are aligned to their
+// size, so a node finds the header of its block by masking its address, and
+// the block is freed along with its last node.
+template <typename T>
+struct Node_block {
+    // room for live and free:
+    static constexpr std::size_t header = (2 * sizeof(std::atomic<std::size_t>) + alignof(Node<T>) - 1)
+                                          / alignof(Node<T>) * alignof(Node<T>);
+    static constexpr std::size_t bytes = std::bit_ceil(std::max<std::size_t>(std::size_t{1} << 16,
+                                                                             header + 64 * sizeof(Node<T>)));
+    static constexpr std::size_t capacity = (bytes - header) / sizeof(Node<T>);
+    std::atomic<std::size_t> live;
+    void (*free)(void*); // of a block not taken from the heap, null otherwise
+
+    // Raw storage for n (at most capacity) nodes, to be constructed in place:
+    static Node<T>* allocate(std::size_t n) {
+        void* p = ::operator new(bytes, std::align_val_t{bytes});
+        return adopt(p, n, nullptr);
+    }
+    // Start a block in the aligned bytes at p, with n references, that
+    // free(p) gives back after the last one:
+    static Node<T>* adopt(void* p, std::size_t n, void (*free)(void*)) {
+        ::new (p) Node_block{n, free};
+        return reinterpret_cast<Node<T>*>(static_cast<char*>(p) + header);
+    }
+    static Node_block* of(const Node<T>* x) {
+        return reinterpret_cast<Node_block*>(reinterpret_cast<std::uintptr_t>(x) & ~(bytes - 1));
+    }
+    static void release(Node<T>* x) { unref(of(x)); }
+    static void unref(Node_block* b) {
+        if (b->live.fetch_sub(1) == 1) {
+            void (*const free)(void*) = b->free;
+            b->~Node_block();
+            if (free) {
+                free(b);
+            } else {
+                ::operator delete(b, std::align_val_t{bytes});
+            }
+        }
+    }
+};
+
+// Where the nodes an RBTree<T> allocates on the calling thread come from
+// while a Scope is alive, instead of the heap (see Node_arena in
+// RBTree_numa.hpp). allocate() returns a slot of a Node_block holding a
+// reference for the node.
+template <typename T>
+class Node_source {
+    static inline thread_local Node_source* current = nullptr;
+
+    protected:
+    ~Node_source() = default;
+
+    public:
+    virtual void* allocate() = 0;
+    // The source of the calling thread's innermost Scope, if any:
+    static Node_source* active() { return current; }
+
+    class Scope {
+        Node_source* saved;
+
+        public:
+        explicit Scope(Node_source& source) : saved{std::exchange(current, &source)} {}
+        ~Scope() { current = saved; }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+};
+
+template <typename RBTree, typename T>
+class const_iterator {
+    RBTree* current;
+
+    public:
+    // From <iterator> we must specify:
+    using value_type = T; 
+    using reference = value_type&;
+    using pointer = value_type*;
+    using difference_type = std::ptrdiff_t; //#include <iterator>
+    using iterator_category = std::forward_iterator_tag; // we didn't implement operator--, only ++
+
+    explicit const_iterator(RBTree* x) : current{x} {} //ctor
+    //const on right for status not changing assurance:
+    reference operator*() const { return current->key; } //old: T&
+    // The node the iterator points to (nullptr at the end):
+    RBTree* get() const { return current; }
+    const_iterator& operator++();  // pre-increment ++i
+    const_iterator operator++(int); // post-increment i++
+    friend bool operator==(const const_iterator& x, const const_iterator& y) {
+          return x.current == y.current;
+    }
+    friend bool operator!=(const const_iterator& x, const const_iterator& y) {
+          return !(x == y); // We can call the operator== since it is friend instead of:
+      // x.current != y.current;
+    }
+};
+
+// Hash used by the hot-key cache of RBTree. Keys without a std::hash all
+// land in the same slot, which degrades the cache to "last key found".
+template <typename T, typename = void>
+struct Key_hash {
+    std::size_t operator()(const T&) const { return 0; }
+};
+template <typename T>
+struct Key_hash<T, decltype(std::hash<T>{}(std::declval<const T&>()), void())> {
+    std::size_t operator()(const T& key) const { return std::hash<T>{}(key); }
+};
+
+// Hash for the Bloom filter of RBTree and the index of Hashed_RBTree, which
+// both miss keys the tree holds unless keys that CMP finds equal hash
+// alike. That holds for std::less and std::greater, which only find equal
+// keys equal, and they use Key_hash. Other comparators have no hash until
+// one is given that agrees with them, e.g. a case-folding hash for a
+// case-insensitive order:
+//   template <> struct Order_hash<std::string, Case_less> { static constexpr bool enabled = true; ... };
+template <typename T, typename CMP>
+struct Order_hash {
+    static constexpr bool enabled = false;
+};
+template <typename T>
+struct Std_order_hash : Key_hash<T> {
+    static constexpr bool enabled = true;
+};
+template <typename T> struct Order_hash<T, std::less<T>> : Std_order_hash<T> {};
+template <typename T> struct Order_hash<T, std::less<>> : Std_order_hash<T> {};
+template <typename T> struct Order_hash<T, std::greater<T>> : Std_order_hash<T> {};
+template <typename T> struct Order_hash<T, std::greater<>> : Std_order_hash<T> {};
+
+// Blocked Bloom filter (Putze, Sanders, Singler): a key sets k bits of a
+// single 64-byte block, so a query costs one cache miss. Hashes are mixed
+// first, since std::hash of an integer is often the integer itself.
+class Blocked_bloom {
+    struct alignas(64) Block {
+        std::uint64_t words[8];
+    };
+    std::vector<Block> blocks;
+    int k = 0;
+
+    static std::uint64_t mix(std::uint64_t h) { // murmur3 finalizer
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        return h ^ (h >> 33);
+    }
+    // Calls f(word, mask) for each of the k bits of hash h:
+    template <typename F>
+    void probe(std::uint64_t h, F f) const {
+        h = mix(h);
+        const auto& b = blocks[static_cast<std::size_t>((h >> 32) * blocks.size() >> 32)];
+        for (int i = 0; i < k; ++i) {
+            h = h * 0x9E3779B97F4A7C15ull + 0x632BE59BD9B4E019ull;
+            const unsigned bit = static_cast<unsigned>(h >> 55); // 0..511
+            f(const_cast<std::uint64_t&>(b.words[bit >> 6]), std::uint64_t{1} << (bit & 63));
+        }
+    }
+
+    public:
+    Blocked_bloom() = default;
+    // Room for `keys` keys at bits_per_key bits each:
+    Blocked_bloom(std::size_t keys, double bits_per_key)
+        : blocks(std::max<std::size_t>(1, static_cast<std::size_t>(static_cast<double>(keys) * bits_per_key / 512) + 1)),
+          k{std::clamp(static_cast<int>(std::lround(bits_per_key * 0.693)), 1, 16)} {}
+
+    bool empty() const { return blocks.empty(); }
+    std::size_t bytes() const { return blocks.size() * sizeof(Block); }
+    void add(std::uint64_t h) {
+        probe(h, [](std::uint64_t& w, std::uint64_t m) { w |= m; });
+    }
+    bool may_contain(std::uint64_t h) const {
+        bool all = true;
+        probe(h, [&all](std::uint64_t& w, std::uint64_t m) { all &= (w & m) != 0; });
+        return all;
+    }
+};
+
+// Hot-key cache of RBTree: a direct-mapped table from hash(key) to the node
+// found last time for that slot. Const lookups fill it, so readers sharing a
+// lock race on the slots: they are relaxed atomics, and a hit is only taken
+// after comparing the node's key. Nodes are unlinked and freed by writers
+// alone, which also clear their slot.
+template <typename T>
+class Hot_cache {
+    std::unique_ptr<std::atomic<Node<T>*>[]> slots;
+    std::size_t count = 0; // a power of two, 0 when disabled
+
+    public:
+    Hot_cache() = default;
+    Hot_cache(Hot_cache&& o) noexcept : slots{std::move(o.slots)}, count{std::exchange(o.count, 0)} {}
+    Hot_cache& operator=(Hot_cache&& o) noexcept {
+        slots = std::move(o.slots);
+        count = std::exchange(o.count, 0);
+        return *this;
+    }
+    bool empty() const { return count == 0; }
+    std::size_t size() const { return count; }
+    // `n` slots, rounded up to a power of two (0 disables the cache):
+    void resize(std::size_t n) {
+        count = n ? std::bit_ceil(n) : 0;
+        slots = count ? std::make_unique<std::atomic<Node<T>*>[]>(count) : nullptr;
+        clear();
+    }
+    void clear() {
+        for (std::size_t i = 0; i < count; ++i) {
+            slots[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+    std::atomic<Node<T>*>& slot(const T& key) const { return slots[Key_hash<T>{}(key) & (count - 1)]; }
+    Node<T>* get(const T& key) const { return slot(key).load(std::memory_order_relaxed); }
+    void put(const T& key, Node<T>* x) const { slot(key).store(x, std::memory_order_relaxed); }
+    // Drop x before it is freed:
+    void forget(const Node<T>* x) {
+        if (count && get(x->key) == x) {
+            put(x->key, nullptr);
+        }
+    }
+    // Replace every cached node x by f(x):
+    template <typename F>
+    void remap(F f) {
+        for (std::size_t i = 0; i < count; ++i) {
+            slots[i].store(f(slots[i].load(std::memory_order_relaxed)), std::memory_order_relaxed);
+        }
+    }
+};
+
+// Run f(lo, hi) on `threads` contiguous chunks of [0, n), one thread each:
+template <typename F>
+void parallel_chunks(std::size_t n, unsigned threads, F f) {
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; ++t) {
+        workers.emplace_back(f, n * t / threads, n * (t + 1) / threads);
+    }
+    f(0, n / threads);
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+// Sort each chunk in its own thread, then merge neighbouring runs pairwise
+// (in parallel) until one run is left:
+template <typename T, typename CMP>
+void parallel_sort(std::vector<T>& v, unsigned threads, CMP cmp) {
+    parallel_chunks(v.size(), threads, [&](std::size_t lo, std::size_t hi) {
+        std::sort(v.begin() + lo, v.begin() + hi, cmp);
+    });
+    auto bound = [&](unsigned t) { return v.size() * std::min(t, threads) / threads; };
+    for (unsigned width = 1; width < threads; width *= 2) {
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t + width < threads; t += 2 * width) {
+            workers.emplace_back([&v, &cmp, lo = bound(t), mid = bound(t + width), hi = bound(t + 2 * width)] {
+                std::inplace_merge(v.begin() + lo, v.begin() + mid, v.begin() + hi, cmp);
+            });
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+}
+
+// Thread pool with one task deque per worker: a worker pops its own newest
+// task and, when it runs dry, steals the oldest task of another queue.
+// Threads that are not workers push to a shared queue, and a thread
+// waiting on a Task_group runs pending tasks instead of sleeping, so
+// nested waits cannot deadlock and a pool of t - 1 workers keeps t threads busy.
+class Work_stealing_pool {
+    struct Queue {
+        std::mutex m;
+        std::deque<std::function<void()>> tasks;
+    };
+    std::vector<std::unique_ptr<Queue>> queues; // [0] shared, [i] worker i
+    std::vector<std::thread> workers;
+    std::mutex idle_m;
+    std::condition_variable idle;
+    std::atomic<std::size_t> queued{0};
+    bool stop = false;
+    // Queue of the calling thread in this pool (0 for non-workers):
+    static inline thread_local const Work_stealing_pool* current_pool = nullptr;
+    static inline thread_local std::size_t current_queue = 0;
+
+    std::size_t own_queue() const { return current_pool == this ? current_queue : 0; }
+    void work(std::size_t i);
+
+    public:
+    explicit Work_stealing_pool(unsigned workers);
+    ~Work_stealing_pool();
+    Work_stealing_pool(const Work_stealing_pool&) = delete;
+    Work_stealing_pool& operator=(const Work_stealing_pool&) = delete;
+
+    void submit(std::function<void()>);
+    // Run one pending task, own queue first; false if there was none:
+    bool run_one();
+    std::size_t size() const { return workers.size(); }
+};
+
+// Pool shared by the parallel algorithms when none is given:
+inline Work_stealing_pool& default_pool();
+
+// Tasks spawned on a pool that can be waited for together. The first
+// exception thrown by a task is kept and rethrown by wait():
+class Task_group {
+    Work_stealing_pool& pool;
+    std::atomic<std::size_t> pending{0};
+    std::mutex error_m;
+    std::exception_ptr error;
+
+    // Counts a task as finished however it leaves:
+    struct Done {
+        std::atomic<std::size_t>& pending;
+        ~Done() { --pending; }
+    };
+    void join() {
+        while (pending) {
+            if (!pool.run_one()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    public:
+    explicit Task_group(Work_stealing_pool& p) : pool{p} {}
+    // Waits for the tasks, dropping their exception if wait() was not called:
+    ~Task_group() { join(); }
+    template <typename F>
+    void spawn(F f) {
+        ++pending;
+        try {
+            pool.submit([this, f]() mutable {
+                Done done{pending};
+                try {
+                    f();
+                } catch (...) {
+                    std::lock_guard<std::mutex> lk{error_m};
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+            });
+        } catch (...) {
+            --pending;
+            throw;
+        }
+    }
+    // Help with the pool's tasks until every spawned task has finished:
+    void wait() {
+        join();
+        std::exception_ptr e;
+        {
+            std::lock_guard<std::mutex> lk{error_m};
+            e = std::exchange(error, nullptr);
+        }
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+};
+
+// Balancing policies for RBTree. A policy owns the rebalancing after a
+// structural change and is a friend of the tree, so it can use the shared
+// rotation primitives:
+//   insert_fixup(tree, z)            z is the freshly linked leaf;
+//   delete_fixup(tree, x, xp, color) x took the place of the unlinked node
+//                                    (possibly nullptr), xp is its parent and
+//                                    color the color of the unlinked node;
+//   rebuild_fixup(tree)              the tree was rebuilt perfectly balanced,
+//                                    colored by depth and ranked by height.
+
+// Classic bottom-up Red-Black Tree (CLRS):
+struct RB_balance {
+    template <typename Tree, typename N> static void insert_fixup(Tree&, N*);
+    template <typename Tree, typename N> static void delete_fixup(Tree&, N*, N*, Color);
+    template <typename Tree> static void rebuild_fixup(Tree&) {}
+
+    private:
+    template <typename N> static bool is_red(const N* x) { return x && x->color == Color::red; }
+};
+
+// AVL tree: rank is the height of the node (leaves have height 0):
+struct AVL_balance {
+    template <typename Tree, typename N> static void insert_fixup(Tree&, N*);
+    template <typename Tree, typename N> static void delete_fixup(Tree&, N*, N*, Color);
+    template <typename Tree> static void rebuild_fixup(Tree&) {}
+
+    private:
+    template <typename N> static int rank(const N* x) { return x ? x->rank : -1; }
+    template <typename N> static void update(N* x) {
+        x->rank = static_cast<std::uint8_t>(1 + std::max(rank(x->children[0].get()), rank(x->children[1].get())));
+    }
+    // Restore the balance of x, returning the root of its subtree:
+    template <typename Tree, typename N> static N* rebalance(Tree&, N*);
+};
+
+// Weak AVL tree (Haeupler, Sen, Tarjan): rank differences are 1 or 2 and
+// leaves have rank 0. Deletions need O(1) amortized rotations and rank changes.
+struct WAVL_balance {
+    template <typename Tree, typename N> static void insert_fixup(Tree&, N*);
+    template <typename Tree, typename N> static void delete_fixup(Tree&, N*, N*, Color);
+    template <typename Tree> static void rebuild_fixup(Tree&) {}
+
+    private:
+    template <typename N> static int rank(const N* x) { return x ? x->rank : -1; }
+};
+
+// Left-leaning Red-Black Tree (Sedgewick): red links always lean left.
+// Deletion reuses the classic fixup and then leans the touched path back left.
+struct LLRB_balance {
+    template <typename Tree, typename N> static void insert_fixup(Tree&, N*);
+    template <typename Tree, typename N> static void delete_fixup(Tree&, N*, N*, Color);
+    template <typename Tree> static void rebuild_fixup(Tree&);
+
+    private:
+    template <typename N> static bool is_red(const N* x) { return x && x->color == Color::red; }
+    // Lean h left and split it if it is a 4-node, returning the root of its subtree:
+    template <typename Tree, typename N> static N* normalize(Tree&, N*);
+    template <typename Tree, typename N> static void normalize_subtree(Tree&, N*);
+};
+
+// Coroutines for interleaving many lookups on one thread. A lookup yields
+// at each level after prefetching the node it visits next, and the thread's
+// Lookup_scheduler resumes the other lookups while the cache line arrives.
+
+// Free lists of coroutine frames, per thread: lookups start and finish at
+// a high rate and would otherwise each cost a malloc/free pair. A frame goes
+// back to the lists of the thread that frees it, so a task should start and
+// finish on one thread, as tasks run by a Lookup_scheduler do; a task moved
+// to another thread in between leaks nothing, but its frame changes lists.
+class Frame_pool {
+    static constexpr std::size_t granule = 64;
+    std::array<std::vector<void*>, 16> free; // by size in granules
+    static Frame_pool& local() {
+        thread_local Frame_pool pool;
+        return pool;
+    }
+
+    public:
+    Frame_pool() = default;
+    Frame_pool(const Frame_pool&) = delete;
+    Frame_pool& operator=(const Frame_pool&) = delete;
+    ~Frame_pool() {
+        for (auto& list : free) {
+            for (void* p : list) {
+                ::operator delete(p);
+            }
+        }
+    }
+    static void* allocate(std::size_t n) {
+        const std::size_t c = (n + granule - 1) / granule;
+        if (c >= local().free.size()) {
+            return ::operator new(n);
+        }
+        auto& list = local().free[c];
+        if (list.empty()) {
+            return ::operator new(c * granule);
+        }
+        void* p = list.back();
+        list.pop_back();
+        return p;
+    }
+    static void deallocate(void* p, std::size_t n) {
+        const std::size_t c = (n + granule - 1) / granule;
+        if (c >= local().free.size()) {
+            ::operator delete(p);
+        } else {
+            local().free[c].push_back(p);
+        }
+    }
+};
+
+// Runs the coroutines posted to it, in turn, on the thread calling run().
+// Awaiting Yield{} from a coroutine it runs posts it back to the end of the
+// queue; outside run(), Yield{} does not suspend at all. A spawned task that
+// throws ends there, and run() rethrows the first such exception once the
+// other tasks are done.
+class Lookup_scheduler {
+    struct Root {
+        std::coroutine_handle<> h;
+        const std::exception_ptr* error; // in the promise of h
+    };
+    std::deque<std::coroutine_handle<>> ready;
+    std::vector<Root> roots; // spawned, destroyed by run()
+    static inline thread_local Lookup_scheduler* running = nullptr;
+
+    public:
+    Lookup_scheduler() = default;
+    Lookup_scheduler(const Lookup_scheduler&) = delete;
+    Lookup_scheduler& operator=(const Lookup_scheduler&) = delete;
+    ~Lookup_scheduler() {
+        for (auto& r : roots) {
+            r.h.destroy();
+        }
+    }
+    static Lookup_scheduler* current() { return running; }
+    void post(std::coroutine_handle<> h) { ready.push_back(h); }
+    // Take over a Task<void> to be started by run():
+    template <typename Task>
+    void spawn(Task&& task) {
+        auto h = task.release();
+        roots.push_back({h, &h.promise().error});
+        post(h);
+    }
+    // Resume posted coroutines until none is left, then free the spawned ones:
+    void run() {
+        Lookup_scheduler* outer = std::exchange(running, this);
+        while (!ready.empty()) {
+            auto h = ready.front();
+            ready.pop_front();
+            h.resume();
+        }
+        running = outer;
+        std::exception_ptr error;
+        for (auto& r : roots) {
+            if (!error) {
+                error = *r.error;
+            }
+            r.h.destroy();
+        }
+        roots.clear();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    struct Yield {
+        bool await_ready() const noexcept { return running == nullptr; }
+        void await_suspend(std::coroutine_handle<> h) const { running->post(h); }
+        void await_resume() const noexcept {}
+    };
+};
+
+template <typename R>
+struct Task_result {
+    std::optional<R> value;
+    void return_value(R v) { value.emplace(std::move(v)); }
+    R take() { return std::move(*value); }
+};
+template <>
+struct Task_result<void> {
+    void return_void() {}
+    void take() {}
+};
+
+// Lazily started coroutine returning R: awaiting it runs it, and its result
+// (or what it threw) comes back to the awaiting coroutine when it finishes.
+template <typename R = void>
+class Task {
+    public:
+    struct promise_type : Task_result<R> {
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+        std::exception_ptr error;
+        Task get_return_object() { return Task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept {
+            struct Resume_awaiter {
+                bool await_ready() const noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                    return h.promise().continuation;
+                }
+                void await_resume() const noexcept {}
+            };
+            return Resume_awaiter{};
+        }
+        void unhandled_exception() { error = std::current_exception(); }
+        static void* operator new(std::size_t n) { return Frame_pool::allocate(n); }
+        static void operator delete(void* p, std::size_t n) { Frame_pool::deallocate(p, n); }
+    };
+
+    private:
+    std::coroutine_handle<promise_type> h;
+    explicit Task(std::coroutine_handle<promise_type> h) : h{h} {}
+
+    public:
+    Task(Task&& t) noexcept : h{std::exchange(t.h, {})} {}
+    Task& operator=(Task&& t) noexcept {
+        std::swap(h, t.h);
+        return *this;
+    }
+    ~Task() {
+        if (h) {
+            h.destroy();
+        }
+    }
+    // Give up the coroutine (for Lookup_scheduler::spawn):
+    std::coroutine_handle<promise_type> release() { return std::exchange(h, {}); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        h.promise().continuation = caller;
+        return h;
+    }
+    R await_resume() {
+        if (h.promise().error) {
+            std::rethrow_exception(h.promise().error);
+        }
+        return h.promise().take();
+    }
+};
+
+template <typename T, typename CMP, typename Balance>
+class Hashed_RBTree;
+
+// Node unlinked by RBTree::extract. It owns the node, key included, until an
+// insert links it into a tree again without allocating or copying the key.
+template <typename T>
+class Node_handle {
+    template <typename, typename, typename> friend class RBTree;
+    std::unique_ptr<Node<T>> node;
+    explicit Node_handle(std::unique_ptr<Node<T>> n) noexcept : node{std::move(n)} {}
+
+    public:
+    Node_handle() noexcept = default;
+    bool empty() const { return !node; }
+    explicit operator bool() const { return node != nullptr; }
+    // The key, which may be changed while the node is out of any tree:
+    T& value() const { return node->key; }
+};
+
+// Class to represent Red-Black Tree
+template <typename T, typename CMP=std::less<T>, typename Balance=RB_balance>
+class RBTree {
+    friend Balance;
+    friend RB_balance; // LLRB_balance reuses its delete_fixup
+    friend Hashed_RBTree<T, CMP, Balance>; // links and unlinks nodes it already found
+    template <typename, typename, typename> friend class RBTree; // merge across policies
+
+    public:
+    std::unique_ptr< Node<T>> root;
+    CMP cmp;
+
+    private:
+    std::size_t live = 0;
+    std::size_t tombstones = 0; // only left by lazy deletion
+    // Compare inline key prefixes first (only valid for the order of std::less):
+    static constexpr bool use_prefix = Key_prefix<T>::enabled && std::is_same<CMP, std::less<T>>::value;
+    static std::uint64_t prefix_of(const T& key) { return use_prefix ? Key_prefix<T>::of(key) : 0; }
+    static std::uint64_t prefix_of(const Node<T>* x) { return use_prefix ? x->prefix() : 0; }
+
+    // State of the optional modes, allocated when the first one is enabled,
+    // so that a plain tree pays a null pointer for all of them:
+    struct Extras {
+        Hot_cache<T> hot_cache; // empty when disabled
+        Latency_log* latency = nullptr;
+        // Bloom filter in front of the tree: a miss answers a search without
+        // walking it. Deleted keys keep their bits until the filter is rebuilt
+        // from the live keys, once they pile up or the tree doubles. Empty
+        // when disabled.
+        Blocked_bloom bloom;
+        double bloom_bits_per_key = 0;
+        std::size_t bloom_capacity = 0; // keys the filter was sized for
+        std::size_t bloom_stale = 0;    // keys deleted since the last rebuild
+        // Lazy deletion: Delete only marks a tombstone, and the tree is rebuilt
+        // without them once they exceed tombstone_threshold of the nodes.
+        bool lazy_delete = false;
+        double tombstone_threshold = 0.25;
+        // Rotations performed while counting them (for the balancing benchmarks):
+        bool count_rotations = false;
+        std::size_t rotations = 0;
+    };
+    std::unique_ptr<Extras> extras;
+
+    // Smallest and largest live nodes, for O(1) begin/front/back:
+    Node<T>* leftmost = nullptr;
+    Node<T>* rightmost = nullptr;
+
+    // PRIVATE METHODS
+    Extras& extra() {
+        if (!extras) {
+            extras = std::make_unique<Extras>();
+        }
+        return *extras;
+    }
+    // Log of the latency recording mode, null when it is off:
+    Latency_log* latency() const { return extras ? extras->latency : nullptr; }
+    bool lazy_deleting() const { return extras && extras->lazy_delete; }
+    // The Bloom filter if it is enabled:
+    Blocked_bloom* bloom() const { return extras && !extras->bloom.empty() ? &extras->bloom : nullptr; }
+    // The hot-key cache if it is enabled:
+    Hot_cache<T>* hot_cache() const { return extras && !extras->hot_cache.empty() ? &extras->hot_cache : nullptr; }
+    // A new node, from the Node_source of the calling thread if it has one:
+    static std::unique_ptr<Node<T>> new_node(const T& key) {
+        if (Node_source<T>* source = Node_source<T>::active()) {
+            Node<T>* x = ::new (source->allocate()) Node<T>{key};
+            x->pooled = true;
+            return std::unique_ptr<Node<T>>{x};
+        }
+        return std::make_unique<Node<T>>(key);
+    }
+    // The unique_ptr owning x (root or a child link of x's parent):
+    std::unique_ptr<Node<T>>& link_of(Node<T>* x) {
+        return !x->parent ? root : x->parent->children[x->is_right_child()];
+    }
+    Node<T>* search_subtree(Node<T>*, const T&) const;
+    // Link node, or revive the tombstone of its key, returning the node that
+    // holds the key. If the key is already live it returns nullptr; node is
+    // only taken when it is linked. The search starts at `start` (the root if
+    // null), whose subtree must span the key:
+    Node<T>* insert(std::unique_ptr<Node<T>>&&, Node<T>* start = nullptr);
+    // Climb from x to the lowest ancestor whose subtree spans key:
+    Node<T>* spanning_ancestor(Node<T>* x, const T& key) const;
+    // Replace x by y in the tree. It returns the ptr to the removed x:
+    Node<T>* transplant(Node<T>* x, std::unique_ptr<Node<T>>&& y);
+    // Rotate the subtree owned by `link` so that its root goes down on side `dir`:
+    void rotate(std::unique_ptr<Node<T>>&& link, side dir);
+    // Last node of the subtree on side dir, and in-order neighbour on side dir:
+    Node<T>* extreme_in_subtree(Node<T>*, side dir) const;
+    Node<T>* neighbour(const Node<T>*, side dir) const;
+    // Delete a node form a Binary Search tree:
+    Node<T>* Delete_BTS(Node<T>* );
+    // Unlink a node from the Red Black tree, handing it back to the caller:
+    std::unique_ptr<Node<T>> unlink(Node<T>*);
+    // Delete a node form a Red Black tree:
+    bool Delete(Node<T>* z) {
+        if (!z) {
+            return false;
+        }
+        auto node = unlink(z);
+        Phase_clock clock{latency()};
+        node.reset();
+        clock.lap(Phase::delete_free);
+        return true;
+    }
+    // Mark a node as deleted without unlinking it:
+    bool bury(Node<T>*);
+    // Neighbours of x that are not tombstones:
+    Node<T>* next_live(const Node<T>* x) const {
+        Node<T>* y = successor(x);
+        while (y && y->dead) {
+            y = successor(y);
+        }
+        return y;
+    }
+    Node<T>* prev_live(const Node<T>* x) const {
+        Node<T>* y = predecessor(x);
+        while (y && y->dead) {
+            y = predecessor(y);
+        }
+        return y;
+    }
+    // Update leftmost/rightmost for a node that just became live:
+    void extend_bounds(Node<T>* x) {
+        if (!leftmost || cmp(x->key, leftmost->key)) {
+            leftmost = x;
+        }
+        if (!rightmost || cmp(rightmost->key, x->key)) {
+            rightmost = x;
+        }
+    }
+    // ...and for a node that is about to stop being live:
+    void shrink_bounds(const Node<T>* x) {
+        if (x == leftmost) {
+            leftmost = next_live(x);
+        }
+        if (x == rightmost) {
+            rightmost = prev_live(x);
+        }
+    }
+    void rebuild_bloom();
+    // Hash of key for the filter, which only exists with an Order_hash:
+    static std::size_t bloom_hash(const T& key) {
+        if constexpr (Order_hash<T, CMP>::enabled) {
+            return Order_hash<T, CMP>{}(key);
+        } else {
+            return 0;
+        }
+    }
+    void bloom_add(const T& key) {
+        if (Blocked_bloom* filter = bloom()) {
+            filter->add(bloom_hash(key));
+            if (live > 2 * extras->bloom_capacity) {
+                rebuild_bloom();
+            }
+        }
+    }
+    void bloom_forget(std::size_t keys = 1) {
+        // rebuilding costs O(live), paid for by the live / 2 deletes before it
+        if (bloom() && (extras->bloom_stale += keys) > std::max<std::size_t>(live / 2, 512)) {
+            rebuild_bloom();
+        }
+    }
+    // Drop x from the hot-key cache before it is freed:
+    void forget(Node<T>* x) {
+        if (auto cache = hot_cache()) {
+            cache->forget(x);
+        }
+    }
+    // Link nodes[lo, hi) (sorted) into a perfectly balanced subtree, whose
+    // nodes at depth red_depth are red and whose ranks are their heights.
+    // The left subtrees of the nodes above fork_depth are linked as tasks of pool:
+    std::unique_ptr<Node<T>> build_balanced(std::vector<std::unique_ptr<Node<T>>>&,
+        std::size_t lo, std::size_t hi, Node<T>* parent, int depth, int red_depth,
+        int fork_depth = 0, Work_stealing_pool* pool = nullptr);
+    // Replace the tree by the sorted live nodes, perfectly balanced:
+    void link_balanced(std::vector<std::unique_ptr<Node<T>>>&, int fork_depth);
+    // Black nodes on the way from the root down to a missing child:
+    int black_height() const;
+    // Join the tree in root (black height bh) with x and the subtree r
+    // (black height rbh), whose keys lie on side s of x, returning the black
+    // height of the result. Classic Red-Black balance only:
+    int join(int bh, std::unique_ptr<Node<T>> x, std::unique_ptr<Node<T>> r, int rbh, side s);
+    // Recompute leftmost/rightmost from scratch:
+    void reset_bounds();
+    // Every node (tombstones too), in order of key or in van Emde Boas order:
+    std::vector<Node<T>*> nodes_in(Node_order) const;
+    static void veb_order(Node<T>* x, int levels, std::vector<Node<T>*>&);
+    // Visit every node without recursion or a stack: open(x) on the way down,
+    // middle(x) between the subtrees, close(x) on the way up, and empty() for
+    // each missing child:
+    template <typename Open, typename Middle, typename Close, typename Empty>
+    void euler_walk(Open, Middle, Close, Empty) const;
+    // In-order walk of the live keys of the subtree at x:
+    template <typename F>
+    static void walk_subtree(const Node<T>* x, F&& f);
+    // Subtrees of x above split_depth fork their left child as a task:
+    template <typename F>
+    void for_each_subtree(const Node<T>* x, F& f, int depth, int split_depth, Work_stealing_pool&) const;
+    template <typename R, typename Fold, typename Combine>
+    R reduce_subtree(const Node<T>* x, const R& init, Fold& fold, Combine& combine,
+                     int depth, int split_depth, Work_stealing_pool&) const;
+
+    public:
+    // ctor
+    RBTree() noexcept : cmp{}{}
+    // default dtor
+    ~RBTree() noexcept = default;
+    RBTree(RBTree&&) noexcept = default;
+    RBTree& operator=(RBTree&&) noexcept = default;
+
+    using _iterator = const_iterator<Node<T>, const T>; //const ref returned
+    auto begin() const { return _iterator{leftmost}; }
+    auto end() const { return _iterator{nullptr}; }
+
+    // PUBLIC METHODS
+    Node<T>* minimum_in_subtree(Node<T>* x) const { return extreme_in_subtree(x, side::left); }
+    Node<T>* maximum_in_subtree(Node<T>* x) const { return extreme_in_subtree(x, side::right); }
+    Node<T>* successor(const Node<T>* x) const { return neighbour(x, side::right); }
+    Node<T>* predecessor(const Node<T>* x) const { return neighbour(x, side::left); }
+    // Average depth of the keys (root has depth 0):
+    double average_depth() const;
+
+    // Number of keys in the tree (tombstones excluded):
+    std::size_t size() const { return live; }
+    bool empty() const { return live == 0; }
+    std::size_t tombstone_count() const { return tombstones; }
+    // Count the rotations from now on, or stop counting them; rotations()
+    // returns the count so far (for the balancing benchmarks):
+    void count_rotations(bool enable = true) { extra().count_rotations = enable; }
+    std::size_t rotations() const { return extras ? extras->rotations : 0; }
+    // Switch lazy deletion on or off; switching it off drops the tombstones:
+    void set_lazy_delete(bool enable, double threshold = 0.25);
+    // Rebuild the tree without its tombstones, returning the bytes freed:
+    std::size_t compact_tombstones();
+    // Where the nodes are and how much memory they take:
+    Memory_usage memory_usage() const;
+    // Move every node into contiguous blocks in the given order, keeping the
+    // shape, colors and keys of the tree:
+    void compact(Node_order order = Node_order::van_emde_boas);
+    // Put a blocked Bloom filter of about bits_per_key bits per key in front
+    // of the tree (0 removes it). Each extra bit per key roughly halves the
+    // false positives once there are more than a few. Keys are hashed with
+    // Order_hash<T, CMP>:
+    void enable_bloom_filter(double bits_per_key = 10);
+    // False only if key is surely absent (always true without a filter):
+    bool may_contain(const T& key) const {
+        const Blocked_bloom* filter = bloom();
+        return !filter || filter->may_contain(bloom_hash(key));
+    }
+    std::size_t bloom_bytes() const { return extras ? extras->bloom.bytes() : 0; }
+    // Cache the nodes of recently found keys in a table of `slots` entries
+    // (rounded up to a power of two, 0 disables it). Lookups may still run
+    // concurrently under a shared lock, since the cache tolerates racing readers:
+    void enable_hot_cache(std::size_t slots);
+    // Replace the contents of the tree by the keys in [first, last), which
+    // need not be sorted and may repeat: the keys are sorted and the nodes
+    // allocated using `threads` threads, then linked by the tasks of
+    // default_pool().
+    template <typename It>
+    void build_parallel(It first, It last, unsigned threads = std::thread::hardware_concurrency());
+
+    // Apply f to every key concurrently: the subtrees below split_depth are
+    // tasks of pool, each walked in order. f must be safe to call from
+    // several threads at once.
+    template <typename F>
+    void parallel_for_each(F f, int split_depth = 8, Work_stealing_pool& pool = default_pool()) const {
+        for_each_subtree(root.get(), f, 0, split_depth, pool);
+    }
+    // Fold the keys in order: each task folds its keys into a copy of init
+    // with fold(R, const T&), and the partial results are combined left to
+    // right with combine(R, R). combine must be associative (not necessarily
+    // commutative) and init must be its identity.
+    template <typename R, typename Fold, typename Combine>
+    R parallel_reduce(R init, Fold fold, Combine combine, int split_depth = 8,
+                      Work_stealing_pool& pool = default_pool()) const {
+        return reduce_subtree(root.get(), init, fold, combine, 0, split_depth, pool);
+    }
+    template <typename R, typename Op>
+    R parallel_reduce(R init, Op op) const { return parallel_reduce(init, op, op); }
+
+    // To search a value from the tree:
+    Node<T>* search_subtree(const T& key) const;
+    _iterator find(const T& key) const { return _iterator{search_subtree(key)}; }
+    // Finger search: start from hint and climb only until the subtree spans
+    // key, which costs O(log d) for keys d positions away from hint unless
+    // the two straddle a high ancestor:
+    _iterator find(_iterator hint, const T& key) const;
+    // Awaitable find for interleaving lookups under a Lookup_scheduler: the
+    // descent prefetches each node it moves to and yields before reading it.
+    Task<_iterator> async_find(T key) const;
+    // First key not less than key (end() if there is none):
+    _iterator lower_bound(const T& key) const;
+    // To insert a new value in the tree:
+    void insert(const T&);
+    // Insert key with a finger search from hint (see find(hint, key)),
+    // returning its position whether it was inserted or already there:
+    _iterator insert(_iterator hint, const T& key);
+    // To insert a value unless it is already there, without complaining:
+    bool try_insert(const T& key) {
+        Phase_clock clock{latency()};
+        auto z = new_node(key);
+        clock.lap(Phase::insert_alloc);
+        bool inserted = insert(std::move(z)) != nullptr;
+        clock.done(Phase::insert);
+        return inserted;
+    }
+    // To test whether the tree contains a value:
+    bool contains(const T& key) const{
+        Phase_clock clock{latency()};
+        bool found = search_subtree(key) != nullptr;
+        clock.done(Phase::contains);
+        return found;
+    }
+    // To delete a value from the tree:      
+    bool Delete(const T& key) {
+        Phase_clock clock{latency()};
+        auto z = search_subtree(key);
+        clock.lap(Phase::delete_search);
+        bool done = lazy_deleting() ? bury(z) : Delete(z);
+        clock.done(Phase::Delete);
+        return done;
+    }
+
+    // Outcome of inserting a node handle: where the key is, and the handle
+    // back if the key was already there.
+    struct Insert_result {
+        _iterator position;
+        bool inserted;
+        Node_handle<T> node;
+    };
+    // Unlink the node of a key (even in lazy mode) without freeing it; the
+    // handle is empty if the key is absent:
+    Node_handle<T> extract(_iterator it);
+    Node_handle<T> extract(const T& key) { return extract(find(key)); }
+    // Link an extracted node, with no allocation:
+    Insert_result insert(Node_handle<T>&& nh);
+    // Move every node of other whose key is not here yet into this tree:
+    template <typename B2>
+    void merge(RBTree<T, CMP, B2>& other);
+    // Delete the key at it without searching for it, returning the next key:
+    _iterator erase(_iterator it);
+
+    // Latency recording mode: insert, Delete and contains time each of
+    // their phases into log (nullptr switches it off):
+    void record_latencies(Latency_log* log) {
+        Tick_clock::ns_per_tick(); // calibrate now rather than in the first operation
+        if (log || extras) {
+            extra().latency = log;
+        }
+    }
+
+    // Smallest and largest keys in O(1), the tree must not be empty:
+    const T& front() const { return leftmost->key; }
+    const T& back() const { return rightmost->key; }
+    // Remove and return the smallest/largest key without searching for it,
+    // the tree must not be empty. The node is always unlinked, even in lazy mode:
+    T pop_min() { return std::move(unlink(leftmost)->key); }
+    T pop_max() { return std::move(unlink(rightmost)->key); }
+
+    // Move the keys k with below(k), which must be a prefix of the order,
+    // into the returned tree. The search path is cut and its pieces joined
+    // back by black height: O(log n) rotations and recolorings however many
+    // keys move, plus one visit per moved node for the counters. Classic
+    // Red-Black balance only.
+    template <typename Below>
+    RBTree split_while(Below below);
+    RBTree split_before(const T& key) { return split_while([this, &key](const T& k) { return cmp(k, key); }); }
+
+    // Stream the tree in `format` to sink, in chunks of up to
+    // Export_buffer::chunk_size bytes:
+    void export_to(Export_format format, std::function<void(const char*, std::size_t)> sink) const;
+    void export_to(Export_format format, std::ostream& os) const {
+        export_to(format, [&os](const char* s, std::size_t n) { os.write(s, static_cast<std::streamsize>(n)); });
+    }
+};
+
+// To print the tree in-order-walk:
+template <typename T>
+std::ostream& operator<<(std::ostream&, Node<T>*);
+template <typename T, typename CMP, typename B>
+std::ostream& operator<<(std::ostream&, const RBTree<T,CMP,B>&);
+
+// Struct to represent a node of the top-down Red-Black Tree.
+// There is no parent pointer: rebalancing happens on the way down,
+// so nobody ever needs to climb back up.
+template <typename T>
+struct TDNode {
+    T key;
+    Color color;
+    std::unique_ptr< TDNode<T> > children[2]; // indexed by side: [0] left, [1] right
+
+    public:
+    // custom ctors
+    explicit TDNode(const T& key) noexcept : key{key}, color{Color::red} {}
+    explicit TDNode(T&& key) noexcept : key{std::move(key)}, color{Color::red} {}
+    // default dtor
+    ~TDNode() noexcept = default;
+};
+
+// Iterator for trees without parent links: it carries its own stack of the
+// ancestors still to be visited, so ++ is amortized O(1) without climbing.
+template <typename Node, typename T>
+class path_const_iterator {
+    std::vector<Node*> path;
+    void push_left_spine(Node* x) {
+        for (; x; x = x->children[0].get()) {
+            path.push_back(x);
+        }
+    }
+
+    public:
+    using value_type = T;
+    using reference = value_type&;
+    using pointer = value_type*;
+    using difference_type = std::ptrdiff_t;
+    using iterator_category = std::forward_iterator_tag;
+
+    explicit path_const_iterator(Node* root) { push_left_spine(root); } //ctor
+    reference operator*() const { return path.back()->key; }
+    pointer operator->() const { return &path.back()->key; }
+    path_const_iterator& operator++() {  // pre-increment ++i
+        Node* x = path.back();
+        path.pop_back();
+        push_left_spine(x->children[1].get());
+        return *this;
+    }
+    path_const_iterator operator++(int) {  // post-increment i++
+        auto tmp = *this;
+        ++(*this);
+        return tmp;
+    }
+    friend bool operator==(const path_const_iterator& x, const path_const_iterator& y) {
+        return (x.path.empty() ? nullptr : x.path.back()) == (y.path.empty() ? nullptr : y.path.back());
+    }
+    friend bool operator!=(const path_const_iterator& x, const path_const_iterator& y) {
+        return !(x == y);
+    }
+};
+
+// Class to represent a Red-Black Tree rebalanced top-down in a single pass
+// (2-3-4 splits on the way down for insert, red pushed down for delete).
+// Same interface as RBTree, but nodes are one pointer smaller.
+template <typename T, typename CMP=std::less<T>>
+class TopDownRBTree {
+    using Link = std::unique_ptr< TDNode<T> >;
+
+    public:
+    Link root;
+    CMP cmp;
+
+    private:
+    // PRIVATE METHODS
+    static bool is_red(const TDNode<T>* x) { return x && x->color == Color::red; }
+    // Rotate the subtree owned by `link` so that its root goes down on side `dir`:
+    static void rotate(Link& link, bool dir);
+    static void rotate_twice(Link& link, bool dir);
+
+    public:
+    // ctor
+    TopDownRBTree() noexcept : cmp{} {}
+    // default dtor
+    ~TopDownRBTree() noexcept = default;
+
+    using _iterator = path_const_iterator<TDNode<T>, const T>;
+    auto begin() const { return _iterator{root.get()}; }
+    auto end() const { return _iterator{nullptr}; }
+
+    // PUBLIC METHODS
+    // To insert a new value in the tree (duplicates are ignored):
+    void insert(const T&);
+    // To test whether the tree contains a value:
+    bool contains(const T&) const;
+    // To delete a value from the tree:
+    bool Delete(const T&);
+};
+
+// Read-only Red-Black Tree built at compile time from a fixed key set. The
+// keys are sorted, deduplicated and laid out flattened in BFS (Eytzinger)
+// order: the children of slot i are slots 2i+1 and 2i+2. The result is a
+// complete tree (a valid Red-Black Tree with its last level red) that needs
+// no pointers, so a constexpr instance is plain read-only data.
+template <typename T, std::size_t N, typename CMP=std::less<T>>
+class Static_RBTree {
+    std::array<T, N> keys{};
+    std::size_t count = 0;
+    CMP cmp{};
+
+    // Store sorted[pos...] in the in-order walk of the subtree at slot i:
+    constexpr void layout(const std::array<T, N>& sorted, std::size_t& pos, std::size_t i) {
+        if (i >= count) {
+            return;
+        }
+        layout(sorted, pos, 2 * i + 1);
+        keys[i] = sorted[pos++];
+        layout(sorted, pos, 2 * i + 2);
+    }
+
+    public:
+    // In-order iterator over the slots of the flattened tree:
+    class const_iterator {
+        const Static_RBTree* tree;
+        std::size_t i;
+
+        public:
+        using value_type = T;
+        using reference = const value_type&;
+        using pointer = const value_type*;
+        using difference_type = std::ptrdiff_t;
+        using iterator_category = std::forward_iterator_tag;
+
+        constexpr const_iterator(const Static_RBTree* t, std::size_t slot) : tree{t}, i{slot} {} //ctor
+        constexpr reference operator*() const { return tree->keys[i]; }
+        constexpr pointer operator->() const { return &tree->keys[i]; }
+        constexpr const_iterator& operator++() {  // pre-increment ++i
+            if (2 * i + 2 < tree->count) {
+                i = 2 * i + 2;
+                while (2 * i + 1 < tree->count) {
+                    i = 2 * i + 1;
+                }
+                return *this;
+            }
+            while (i > 0 && i % 2 == 0) { // climb while i is a right child
+                i = (i - 1) / 2;
+            }
+            i = i == 0 ? tree->count : (i - 1) / 2;
+            return *this;
+        }
+        constexpr const_iterator operator++(int) {  // post-increment i++
+            auto tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+        friend constexpr bool operator==(const const_iterator& x, const const_iterator& y) { return x.i == y.i; }
+        friend constexpr bool operator!=(const const_iterator& x, const const_iterator& y) { return x.i != y.i; }
+    };
+
+    // ctor: sort, drop duplicates and lay out the keys.
+    constexpr explicit Static_RBTree(std::array<T, N> sorted) {
+        std::sort(sorted.begin(), sorted.end(), cmp);
+        auto last = std::unique(sorted.begin(), sorted.end(),
+                                [this](const T& a, const T& b) { return !cmp(a, b) && !cmp(b, a); });
+        count = static_cast<std::size_t>(last - sorted.begin());
+        std::size_t pos = 0;
+        layout(sorted, pos, 0);
+    }
+
+    constexpr const_iterator begin() const {
+        std::size_t i = 0;
+        while (2 * i + 1 < count) {
+            i = 2 * i + 1;
+        }
+        return const_iterator{this, count ? i : count};
+    }
+    constexpr const_iterator end() const { return const_iterator{this, count}; }
+    constexpr std::size_t size() const { return count; }
+
+    // Descend without branching on the comparison: right child iff key > slot.
+    constexpr bool contains(const T& key) const {
+        std::size_t i = 0;
+        while (i < count) {
+            if (!cmp(key, keys[i]) && !cmp(keys[i], key)) {
+                return true;
+            }
+            i = 2 * i + 1 + cmp(keys[i], key);
+        }
+        return false;
+    }
+};
+
+// Compile-time builder: `constexpr auto t = make_static_rbtree(std::array{...});`
+template <typename T, std::size_t N, typename CMP=std::less<T>>
+constexpr Static_RBTree<T, N, CMP> make_static_rbtree(const std::array<T, N>& keys) {
+    return Static_RBTree<T, N, CMP>{keys};
+}
+
+// Epoch-based reclamation for the lock-free readers of Chromatic_tree. A
+// thread announces the global epoch while it may hold pointers into a tree
+// (see Epoch_guard); a node unlinked in epoch e is freed once the epoch has
+// reached e + 2, since by then every thread has left the critical sections
+// that could have seen it. A thread holds one of max_threads slots from its
+// first critical section until it exits, when the slot is given back for
+// another thread: only more than max_threads threads alive at once throw.
+class Epoch_domain {
+    struct Retired {
+        std::uint64_t epoch;
+        void* p;
+        void (*free)(void*);
+    };
+    struct alignas(64) Slot {
+        std::atomic<std::uint64_t> active{0}; // 0 outside critical sections
+        std::atomic<bool> taken{false};
+        unsigned depth = 0;
+        std::vector<Retired> limbo;
+    };
+    static constexpr std::size_t max_threads = 256;
+    Slot slots[max_threads];
+    std::atomic<std::size_t> claimed{0}; // slots ever taken, a prefix of slots
+    std::atomic<std::uint64_t> epoch{1};
+    std::mutex orphans_m;
+    std::vector<Retired> orphans; // limbo of threads that have exited
+
+    Epoch_domain() = default;
+    Slot& slot();
+    void release(Slot&);
+    void try_advance();
+    void collect(std::vector<Retired>&);
+
+    public:
+    static Epoch_domain& instance();
+    ~Epoch_domain();
+    void enter();
+    void leave();
+    // Free p with free(p) once no thread can reach it any more:
+    void retire(void* p, void (*free)(void*));
+};
+
+class Epoch_guard {
+    public:
+    Epoch_guard() { Epoch_domain::instance().enter(); }
+    ~Epoch_guard() { Epoch_domain::instance().leave(); }
+    Epoch_guard(const Epoch_guard&) = delete;
+    Epoch_guard& operator=(const Epoch_guard&) = delete;
+};
+
+// Node of the chromatic tree. Only the child links change after creation:
+// an update replaces nodes by new copies instead of modifying them.
+template <typename T>
+struct CNode {
+    const T key;     // routing key (internal node) or stored key (leaf)
+    const bool inf;  // sentinel key, bigger than every key
+    const int weight; // 0 red, 1 black, more than 1 overweight
+    std::atomic<CNode*> children[2]; // indexed by side, both nullptr in leaves
+    std::atomic<bool> locked{false};  // updates only ever try the lock, so a
+    std::atomic<bool> removed{false}; // flag takes the place of a mutex
+
+    CNode(const T& key, bool inf, int weight, CNode* left, CNode* right)
+        : key{key}, inf{inf}, weight{weight}, children{left, right} {}
+    bool is_leaf() const { return children[0].load(std::memory_order_acquire) == nullptr; }
+    bool try_lock() { return !locked.load(std::memory_order_relaxed) && !locked.exchange(true, std::memory_order_acquire); }
+    void unlock() { locked.store(false, std::memory_order_release); }
+};
+
+// Chromatic tree (Nurmi, Soisalon-Soininen; Brown, Ellen, Ruppert): a
+// leaf-oriented Red-Black Tree whose balance is relaxed. Keys live in the
+// leaves, node weights replace colors, and the sum of the weights is the same
+// on every root-to-leaf path. An insert or Delete replaces a few nodes
+// around one leaf and may leave a violation (two red nodes in a row, or an
+// overweight node) on the path to its key; the writer then repairs the
+// violations it finds on that path one transformation at a time, which also
+// helps the other writers. Every change locks only the nodes it replaces
+// (try_lock, validate, swing one child pointer, retry on conflict), and
+// readers take no lock at all.
+template <typename T, typename CMP=std::less<T>>
+class Chromatic_tree {
+    using N = CNode<T>;
+    // A node with the children it had when it was read:
+    struct Frozen {
+        N* x;
+        N* c[2];
+    };
+    // New nodes of one transformation (at most four), freed if it does not
+    // commit:
+    struct Change {
+        N* fresh[4];
+        std::size_t count = 0;
+        N* make(const T& key, bool inf, int weight, N* left, N* right) {
+            return fresh[count++] = new N{key, inf, weight, left, right};
+        }
+        N* make(const N* from, int weight, std::pair<N*, N*> c) {
+            return make(from->key, from->inf, weight, c.first, c.second);
+        }
+    };
+
+    N* entry; // sentinel of weight 1 above the root (its left child), never replaced
+    CMP cmp;
+
+    // PRIVATE METHODS
+    static Frozen read(N* x) {
+        return {x, {x->children[0].load(std::memory_order_acquire), x->children[1].load(std::memory_order_acquire)}};
+    }
+    // Children in index order, with a on side dir and b on the other:
+    static std::pair<N*, N*> order(bool dir, N* a, N* b) { return dir ? std::make_pair(b, a) : std::make_pair(a, b); }
+    static void free_node(void* p) { delete static_cast<N*>(p); }
+    bool goes_right(const T& key, const N* x) const { return !x->inf && !cmp(key, x->key); }
+    bool holds(const N* leaf, const T& key) const {
+        return !leaf->inf && !cmp(key, leaf->key) && !cmp(leaf->key, key);
+    }
+    // Replace old[0] (child dir of owner) by the subtree at top, provided
+    // that owner still points to old[0] and every node of old still has the
+    // children it was read with. The nodes of old are retired.
+    bool commit(N* owner, bool dir, std::initializer_list<Frozen> old, N* top, Change&);
+    // Repair the violations on the path to key until there is none:
+    void cleanup(const T& key);
+    // x and its parent p are red; u is the parent of p and o that of u:
+    bool fix_red_red(N* o, N* u, N* p, N* x);
+    // The root is red and has a red child:
+    bool fix_red_root(N* root);
+    // x is overweight; u is its parent and o that of u:
+    bool fix_overweight(N* o, N* u, N* x);
+
+    public:
+    // ctor
+    Chromatic_tree() : entry{new N{T{}, true, 1, new N{T{}, true, 1, nullptr, nullptr}, nullptr}}, cmp{} {}
+    ~Chromatic_tree();
+    Chromatic_tree(const Chromatic_tree&) = delete;
+    Chromatic_tree& operator=(const Chromatic_tree&) = delete;
+
+    // PUBLIC METHODS (safe to call from several threads)
+    // To insert a new value in the tree (duplicates are ignored):
+    bool insert(const T&);
+    // To test whether the tree contains a value:
+    bool contains(const T&) const;
+    // To delete a value from the tree:
+    bool Delete(const T&);
+
+    // Only meaningful while no update is running:
+    std::size_t size() const;
+    // Red-red and overweight nodes left (0 once every update has returned):
+    std::size_t violations() const;
+};
+
+// Keys with a time to live. The expiry queue is an RBTree ordered by
+// (deadline, key), next to a hash map from each key to its deadline. A
+// refresh that pushes a deadline back only updates the map: the queue entry
+// keeps the old deadline, and a sweep that meets it queues the key again
+// instead of expiring it. A sweep splits every due entry off the queue at
+// once instead of deleting them one by one.
+template <typename K, typename Clock = std::chrono::steady_clock>
+class Expiry_index {
+    public:
+    using time_point = typename Clock::time_point;
+    using duration = typename Clock::duration;
+    // Outcome of one expire_before:
+    struct Sweep {
+        std::size_t expired = 0;
+        std::size_t requeued = 0; // refreshed keys met in the queue
+        double ms = 0;
+    };
+
+    private:
+    struct Entry {
+        time_point at;
+        K key;
+        bool operator<(const Entry& e) const { return at < e.at || (!(e.at < at) && key < e.key); }
+    };
+    struct Deadline {
+        time_point at;     // current deadline
+        time_point queued; // deadline of the key's entry in the queue, never later than at
+    };
+    RBTree<Entry> queue;
+    std::unordered_map<K, Deadline> deadlines;
+
+    public:
+    // Add key or move its deadline; a later deadline costs one hash update:
+    void set(const K& key, time_point at);
+    void set_ttl(const K& key, duration ttl) { set(key, Clock::now() + ttl); }
+    // Drop key before its deadline:
+    bool erase(const K& key);
+    bool contains(const K& key) const { return deadlines.count(key) != 0; }
+    std::size_t size() const { return deadlines.size(); }
+    // Remove every key due before t, calling on_expire (if any) on each:
+    Sweep expire_before(time_point t, const std::function<void(const K&)>& on_expire = nullptr);
+};
+
+// RBTree with a hash index from key to node beside it: point lookups cost a
+// short probe sequence instead of a walk from the root, while iteration and
+// ordered queries still go through tree(). The index is open addressing with
+// linear probing and backward-shift deletion (no tombstones), kept at most
+// 3/4 full. Keys are hashed with Order_hash<T, CMP>.
+template <typename T, typename CMP=std::less<T>, typename Balance=RB_balance>
+class Hashed_RBTree {
+    static_assert(Order_hash<T, CMP>::enabled, "the hash index needs an Order_hash that agrees with CMP");
+    RBTree<T, CMP, Balance> ordered;
+    std::vector<Node<T>*> slots; // nullptr if empty, a power of two of them
+    int shift;                   // 64 - log2(slots.size())
+    std::size_t count = 0;
+
+    // PRIVATE METHODS
+    // Fibonacci hashing spreads keys whose std::hash is the identity:
+    std::size_t home(const T& key) const {
+        return static_cast<std::size_t>((std::uint64_t{Order_hash<T, CMP>{}(key)} * 0x9E3779B97F4A7C15ull) >> shift);
+    }
+    // Slot holding key, or the empty slot where it would go:
+    std::size_t slot_of(const T& key) const;
+    void erase_slot(std::size_t);
+    void grow();
+
+    public:
+    using _iterator = typename RBTree<T, CMP, Balance>::_iterator;
+
+    // ctor, with room for `expected` keys before the index grows
+    explicit Hashed_RBTree(std::size_t expected = 0);
+
+    auto begin() const { return ordered.begin(); }
+    auto end() const { return ordered.end(); }
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    // The tree itself, for ordered queries:
+    const RBTree<T, CMP, Balance>& tree() const { return ordered; }
+    // Bytes taken by the index on top of the tree:
+    std::size_t index_bytes() const { return slots.capacity() * sizeof(Node<T>*); }
+
+    // PUBLIC METHODS
+    // To insert a new value (duplicates are ignored):
+    bool insert(const T&);
+    bool contains(const T& key) const { return slots[slot_of(key)] != nullptr; }
+    _iterator find(const T& key) const { return _iterator{slots[slot_of(key)]}; }
+    // To delete a value, unlinking its node without searching the tree:
+    bool Delete(const T&);
+};
+
+// RBTree for integer keys under a radix directory: the top Bits bits of the
+// key pick one of 2^Bits independent trees, which takes about Bits levels off
+// every descent. KeyBits is the width the keys actually use. With a smaller
+// KeyBits, negative keys share the first tree and keys from 2^KeyBits up
+// share the last. Buckets are ordered by key, so iteration walks them in turn;
+// a bitmap of the non-empty ones lets it skip the rest. Each bucket costs an
+// empty RBTree (sizeof(RBTree<T>), 64 bytes on LP64) whether used or not, so
+// Bits stops at 16: a 4 MiB directory.
+template <std::integral T, unsigned Bits = 8, unsigned KeyBits = std::numeric_limits<T>::digits + std::is_signed_v<T>,
+          typename Balance = RB_balance>
+class Radix_RBTree {
+    static_assert(Bits > 0 && Bits <= 16 && Bits <= KeyBits, "directory of 2 to 2^16 buckets within the key");
+    static_assert(KeyBits <= std::numeric_limits<T>::digits + std::is_signed_v<T>, "KeyBits wider than the key");
+
+    public:
+    using Tree = RBTree<T, std::less<T>, Balance>;
+    static constexpr std::size_t bucket_count = std::size_t{1} << Bits;
+
+    private:
+    std::vector<Tree> buckets{bucket_count};
+    std::array<std::uint64_t, (bucket_count + 63) / 64> used{}; // bit b: buckets[b] not empty
+    std::size_t count = 0;
+
+    // PRIVATE METHODS
+    // Non-decreasing in key, so that the buckets keep the order of the keys:
+    static std::size_t bucket_of(T key) {
+        using U = std::make_unsigned_t<T>;
+        constexpr unsigned width = std::numeric_limits<U>::digits;
+        if constexpr (KeyBits == width) {
+            U u = static_cast<U>(key);
+            if constexpr (std::is_signed_v<T>) {
+                u ^= U{1} << (width - 1); // negative keys first
+            }
+            return static_cast<std::size_t>(u >> (width - Bits));
+        } else {
+            if constexpr (std::is_signed_v<T>) {
+                if (key < 0) {
+                    return 0;
+                }
+            }
+            const U u = static_cast<U>(key);
+            return u >> KeyBits ? bucket_count - 1 : static_cast<std::size_t>(u >> (KeyBits - Bits));
+        }
+    }
+    void mark(std::size_t b) {
+        const std::uint64_t bit = std::uint64_t{1} << (b & 63);
+        used[b >> 6] = buckets[b].empty() ? used[b >> 6] & ~bit : used[b >> 6] | bit;
+    }
+    // First non-empty bucket from b on (bucket_count if none):
+    std::size_t next_used(std::size_t b) const;
+
+    public:
+    class const_iterator {
+        const Radix_RBTree* dir;
+        std::size_t b;
+        typename Tree::_iterator it;
+
+        public:
+        using value_type = T;
+        using reference = const T&;
+        using pointer = const T*;
+        using difference_type = std::ptrdiff_t;
+        using iterator_category = std::forward_iterator_tag;
+
+        const_iterator(const Radix_RBTree* dir, std::size_t b, typename Tree::_iterator it) : dir{dir}, b{b}, it{it} {}
+        reference operator*() const { return *it; }
+        const_iterator& operator++() {
+            if (++it == typename Tree::_iterator{nullptr}) {
+                b = dir->next_used(b + 1);
+                it = b < bucket_count ? dir->buckets[b].begin() : typename Tree::_iterator{nullptr};
+            }
+            return *this;
+        }
+        const_iterator operator++(int) {
+            auto tmp = *this;
+            ++*this;
+            return tmp;
+        }
+        friend bool operator==(const const_iterator& x, const const_iterator& y) { return x.it == y.it; }
+        friend bool operator!=(const const_iterator& x, const const_iterator& y) { return !(x == y); }
+    };
+
+    const_iterator begin() const {
+        const std::size_t b = next_used(0);
+        return b < bucket_count ? const_iterator{this, b, buckets[b].begin()} : end();
+    }
+    const_iterator end() const { return const_iterator{this, bucket_count, typename Tree::_iterator{nullptr}}; }
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    // The tree holding the keys of bucket b:
+    const Tree& bucket(std::size_t b) const { return buckets[b]; }
+
+    // PUBLIC METHODS
+    // To insert a new value (duplicates are ignored):
+    bool insert(T key);
+    bool contains(T key) const { return buckets[bucket_of(key)].contains(key); }
+    bool Delete(T key);
+    // First key not less than key (end() if there is none):
+    const_iterator lower_bound(T key) const;
+};
+
+// RBTree with a staging buffer in front of its writes. Inserts and deletes
+// land in a small sorted run, which is merged into a larger sorted one
+// whenever it fills (an LSM tree in miniature), and lookups search both
+// runs first. Once `capacity` keys are staged they are applied to the tree
+// in key order, each step a finger search from the previous key: the
+// closer the keys of a batch, the more of their paths are still in cache.
+// Writes are blind (they do not report whether the key was there), and
+// size() and iteration apply the buffer first, so they are not const.
+template <typename T, typename CMP=std::less<T>, typename Balance=RB_balance>
+class Buffered_RBTree {
+    struct Pending {
+        T key;
+        bool insert; // false: delete
+    };
+    RBTree<T, CMP, Balance> ordered;
+    std::vector<Pending> recent; // sorted, at most run_size, one entry per key
+    std::vector<Pending> staged; // sorted, one entry per key
+    std::vector<Pending> spare;  // reused by the merges
+    std::size_t capacity;
+    std::size_t run_size; // about sqrt(capacity): each write moves O(run_size) entries
+    CMP cmp;
+
+    // PRIVATE METHODS
+    typename std::vector<Pending>::const_iterator find_in(const std::vector<Pending>& run, const T& key) const {
+        auto p = std::lower_bound(run.begin(), run.end(), key,
+                                  [this](const Pending& e, const T& k) { return cmp(e.key, k); });
+        return p != run.end() && !cmp(key, p->key) ? p : run.end();
+    }
+    void stage(const T& key, bool insert);
+    // Merge recent into staged, recent winning ties:
+    void merge_recent();
+
+    public:
+    using _iterator = typename RBTree<T, CMP, Balance>::_iterator;
+
+    // ctor: capacity staged keys trigger a flush. A batch pays off once its
+    // keys are dense enough in the tree to share the lower levels of their
+    // paths, so larger trees want larger buffers. Small buffers are a
+    // regression: at 1M random inserts, 256 and 4096 keys are 40% and 10%
+    // slower than the bare tree, while the default 2^16 is twice as fast.
+    explicit Buffered_RBTree(std::size_t capacity = 1 << 16);
+
+    // Apply the staged writes to the tree:
+    void flush();
+    // Writes waiting in the buffer, without flushing it (a key written
+    // since the last merge counts twice):
+    std::size_t pending_count() const { return recent.size() + staged.size(); }
+    // These flush the buffer first:
+    std::size_t size() {
+        flush();
+        return ordered.size();
+    }
+    bool empty() { return size() == 0; }
+    auto begin() {
+        flush();
+        return ordered.begin();
+    }
+    auto end() {
+        flush();
+        return ordered.end();
+    }
+    // The tree itself, with the buffer applied, for ordered queries:
+    const RBTree<T, CMP, Balance>& tree() {
+        flush();
+        return ordered;
+    }
+
+    // PUBLIC METHODS
+    void insert(const T& key) { stage(key, true); }
+    void Delete(const T& key) { stage(key, false); }
+    // The newest write of a key answers first:
+    bool contains(const T& key) const {
+        if (auto p = find_in(recent, key); p != recent.end()) {
+            return p->insert;
+        }
+        if (auto p = find_in(staged, key); p != staged.end()) {
+            return p->insert;
+        }
+        return ordered.contains(key);
+    }
+};
+
+///////////////////////// RBTree IMPLEMENTATION /////////////////////////
+// RBTree PUBLIC METHODS
+template <typename T, typename CMP, typename B>
+Node<T>* RBTree<T,CMP,B>::extreme_in_subtree(Node<T>* node, side dir) const {
+    if (!node) {
+        return node;
+    }
+    while (node->child(dir)) {
+        node = node->child(dir).get();
+    }
+    return node;
+}
+
+template <typename T, typename CMP, typename B>
+Node<T>* RBTree<T,CMP,B>::neighbour(const Node<T>* node, side dir) const{
+    if (node->child(dir)) {
+        return extreme_in_subtree(node->child(dir).get(), get_reverse_side(dir));
+    }
+    Node<T>* parent = node->parent;
+    while (parent && node->get_side() == dir) {
+        node = parent;
+        parent = parent->parent;
+    }
+    return parent;
+}
+
+template <typename T, typename CMP, typename B>
+double RBTree<T,CMP,B>::average_depth() const{
+    std::vector<std::pair<const Node<T>*, std::size_t>> stack;
+    std::size_t nodes = 0;
+    std::size_t depths = 0;
+    if (root) {
+        stack.emplace_back(root.get(), 0);
+    }
+    while (!stack.empty()) {
+        auto x = stack.back();
+        stack.pop_back();
+        ++nodes;
+        depths += x.second;
+        for (const auto& c : x.first->children) {
+            if (c) {
+                stack.emplace_back(c.get(), x.second + 1);
+            }
+        }
+    }
+    return nodes ? static_cast<double>(depths) / nodes : 0.0;
+}
+
+template <typename T, typename CMP, typename B>
+void RBTree<T,CMP,B>::insert(const T& key) {
+    Phase_clock clock{latency()};
+    auto z = new_node(key);
+    clock.lap(Phase::insert_alloc);
+    try {
+        if (!insert(std::move(z))) {
+            throw Multi_insert{
+                "Cannot handle multiple insertions. You gave me " +
+                key_to_string(key)
+            };
+        }
+        clock.done(Phase::insert);
+    } catch (const Multi_insert& e) {
+        std::cerr << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Unknown exception. Aborting.\n";
+        //std::abort();
+    }
+}
+
+
+// RBTree PRIVATE METHODS
+template <typename T, typename CMP, typename B>
+Node<T>* RBTree<T,CMP,B>::search_subtree(const T& key) const{
+    if (!may_contain(key)) {
+        return nullptr;
+    }
+    Hot_cache<T>* cache = hot_cache();
+    if (!cache) {
+        auto x = search_subtree(root.get(), key);
+        return x && !x->dead ? x : nullptr;
+    }
+    Node<T>* hit = cache->get(key);
+    if (hit && !cmp(key, hit->key) && !cmp(hit->key, key)) {
+        return hit->dead ? nullptr : hit;
+    }
+    auto x = search_subtree(root.get(), key);
+    if (!x || x->dead) {
+        return nullptr;
+    }
+    cache->put(key, x);
+    return x;
+}
+
+template <typename T, typename CMP, typename B>
+typename RBTree<T,CMP,B>::_iterator RBTree<T,CMP,B>::find(_iterator hint, const T& key) const{
+    Node<T>* x = hint.get();
+    if (!x) {
+        return find(key);
+    }
+    x = search_subtree(spanning_ancestor(x, key), key);
+    return _iterator{x && !x->dead ? x : nullptr};
+}
+
+template <typename T, typename CMP, typename B>
+Task<typename RBTree<T,CMP,B>::_iterator> RBTree<T,CMP,B>::async_find(T key) const{
+    if (!may_contain(key)) {
+        co_return _iterator{nullptr};
+    }
+    const auto p = prefix_of(key);
+    Node<T>* node = root.get();
+    while (node) {
+        // the same descent as search_subtree(node, key)
+        const auto np = prefix_of(node);
+        bool dir = np < p;
+        if (p == np) {
+            dir = cmp(node->key, key);
+            if (!dir && !cmp(key, node->key)) {
+                break;
+            }
+        }
+        node = node->children[dir].get();
+        if (node) {
+            __builtin_prefetch(node);
+            co_await Lookup_scheduler::Yield{};
+        }
+    }
+    co_return _iterator{node && !node->dead ? node : nullptr};
+}
+
+template <typename T, typename CMP, typename B>
+typename RBTree<T,CMP,B>::_iterator RBTree<T,CMP,B>::insert(_iterator hint, const T& key) {
+    Phase_clock clock{latency()};
+    auto z = new_node(key);
+    clock.lap(Phase::insert_alloc);
+    Node<T>* x = insert(std::move(z), hint.get() ? spanning_ancestor(hint.get(), key) : nullptr);
+    clock.done(Phase::insert);
+    return x ? _iterator{x} : find(hint, key);
+}
+
+template <typename T, typename CMP, typename B>
+typename RBTree<T,CMP,B>::_iterator RBTree<T,CMP,B>::lower_bound(const T& key) const{
+    Node<T>* x = root.get();
+    Node<T>* y = nullptr;
+    while (x) {
+        if (cmp(x->key, key)) {
+            x = x->children[1].get();
+        } else {
+            y = x;
+            x = x->children[0].get();
+        }
+    }
+    _iterator it{y};
+    if (y && y->dead) {
+        ++it;
+    }
+    return it;
+}
+
+template <typename T, typename CMP, typename B>
+void RBTree<T,CMP,B>::enable_hot_cache(std::size_t slots){
+    if (slots || extras) {
+        extra().hot_cache.resize(slots);
+    }
+}
+
+template <typename T, typename CMP, typename B>
+void RBTree<T,CMP,B>::enable_bloom_filter(double bits_per_key){
+    static_assert(Order_hash<T, CMP>::enabled, "the Bloom filter needs an Order_hash that agrees with CMP");
+    if (bits_per_key <= 0 && !extras) {
+        return;
+    }
+    extra().bloom_bits_per_key = bits_per_key;
+    if (bits_per_key > 0) {
+        rebuild_bloom();
+    } else {
+        extras->bloom = Blocked_bloom{};
+    }
+}
+
+template <typename T, typename CMP, typename B>
+void RBTree<T,CMP,B>::rebuild_bloom(){
+    // Sized for the keys of now; the tree may double before the next rebuild:
+    Extras& e = *extras;
+    e.bloom_capacity = std::max<std::size_t>(live, 1024);
+    e.bloom_stale = 0;
+    e.bloom = Blocked_bloom{e.bloom_capacity, e.bloom_bits_per_key};
+    walk_subtree(root.get(), [&e](const T& key) { e.bloom.add(bloom_hash(key)); });
+}
+
+template <typename T, typename CMP, typename B>
+Node<T>* RBTree<T,CMP,B>::search_subtree(Node<T>* node, const T& key) const{
+    const auto p = prefix_of(key);
+    while (node) {
+        // the direction indexes the children, so only a match is a branch
+        const auto np = prefix_of(node);
+        bool dir = np < p;
+        if (p == np) {
+            dir = cmp(node->key, key);
+            if (!dir && !cmp(key, node->key)) {
+                break;
+            }
+        }
+        node = node->children[dir].get();
+    }
+    return node;
+}
+
+template <typename T, typename CMP, typename B>
+Node<T>* RBTree<T,CMP,B>::insert(std::unique_ptr<Node<T>>&& node, Node<T>* start){
+    Phase_clock clock{latency()};
+    Node<T>* x = start ? start : root.get();
+    Node<T>* y = x;
+    const auto p = prefix_of(node.get());
+    bool dir = false;
+    while (x) {
+        y = x;
+        const auto xp = prefix_of(x);
+        dir = xp < p;
+        if (p == xp) {
+            dir = cmp(x->key, node->key);
+        }
+        if (p != xp || dir || cmp(node->key, x->key)) {
+            x = x->children[dir].get();
+        } else if (x->dead) {
+            // lazily deleted: bring the tombstone back instead of linking node
+            x->dead = false;
+            --tombstones;
+            ++live;
+            extend_bounds(x);
+            bloom_add(x->key);
+            clock.lap(Phase::insert_link);
+            return x;
+        } else {
+            return nullptr;
+        }
+    }
+    node->parent = y;
+    Node<T>* z = node.get();
+    (y ? y->children[dir] : root) = std::move(node);
+    ++live;
+    extend_bounds(z);
+    clock.lap(Phase::insert_link);
+    // Restore the balancing invariants:
+    B::insert_fixup(*this, z);
+    clock.lap(Phase::insert_fixup);
+    bloom_add(z->key);
+    return z;
+}
+
+template <typename T, typename CMP, typename B>
+Node<T>* RBTree<T,CMP,B>::spanning_ancestor(Node<T>* x, const T& key) const{
+    if (cmp(x->key, key)) {
+        // climb until an ancestor bigger than key is reached from its left
+        while (x->parent && !(x->get_side() == side::left && cmp(key, x->parent->key))) {
+            x = x->parent;
+        }
+    } else if (cmp(key, x->key)) {
+        while (x->parent && !(x->get_side() == side::right && cmp(x->parent->key, key))) {
+            x = x->parent;
+        }
+    }
+    return x;
+}
+
+template <typename T, typename CMP, typename B>
+void RBTree<T,CMP,B>::rotate(std::unique_ptr<Node<T>>&& link, side dir){
+    if (extras && extras->count_rotations) {
+        ++extras->rotations;
+    }
+    const bool d = static_cast<bool>(dir);
+    Node<T>* x = link.get();
+    auto y = std::move(x->children[!d]);
+    x->children[!d] = std::move(y->children[d]);
+    if (x->children[!d]) {
+        x->children[!d]->parent = x;
+    }
+    y->parent = x->parent;
+    x->parent = y.get();
+    y->children[d] = std::move(link);
+    link = std::move(y);
+}
+
+template <typename T, typename CMP, typename B>
+Node<T>* RBTree<T,CMP,B>::transplant(Node<T>* x, std::unique_ptr<Node<T>>&& y){
+    if (y) {
+        y->parent = x->parent;
+    }
+    auto& link = link_of(x);
+    Node<T>* w = link.release();
+    link = std::move(y);
+    return w;
+}
+
+template <typename T, typename CMP, typename B>
+std::unique_ptr<Node<T>> RBTree<T,CMP,B>::unlink(Node<T>* z){
+    Phase_clock clock{latency()};
+    forget(z);
+    shrink_bounds(z);
+    Color orig_color = z->color;
+    Node<T>* x = nullptr;
+    Node<T>* xp = nullptr;
+    std::unique_ptr<Node<T>> upz;
+    if (!z->children[0] || !z->children[1]) {
+        auto& only = z->children[!z->children[0]];
+        x = only.get();
+        xp = z->parent;
+        upz.reset(transplant(z, std::move(only)));
+    } else {
+        auto y = minimum_in_subtree(z->children[1].get());
+        orig_color = y->color;
+        x = y->children[1].get();
+        xp = y;
+        if (y->parent == z) {
+            if (x) {
+                x->parent = y;
+            }
+            auto pz = transplant(z, std::move(z->children[1]));
+            y->children[0] = std::move(pz->children[0]);
+            y->children[0]->parent = y;
+            y->color = pz->color;
+            y->rank = pz->rank;
+            upz.reset(pz);
+        } else {
+            xp = y->parent;
+            auto py = transplant(y, std::move(y->children[1]));
+            py->children[1] = std::move(z->children[1]);
+            py->children[1]->parent = py;
+            auto upy = std::unique_ptr<Node<T>>(py);
+            auto pz = transplant(z, std::move(upy));
+            py->children[0] = std::move(pz->children[0]);
+            py->children[0]->parent = py;
+            py->color = pz->color;
+            py->rank = pz->rank;
+            upz.reset(pz);
+        }
+    }
+    --live;
+    clock.lap(Phase::delete_unlink);
+    B::delete_fixup(*this, x, xp, orig_color);
+    clock.lap(Phase::delete_fixup);
+    upz->parent = nullptr;
+    bloom_forget();
+    return upz;
+}
+
+template <typename T, typename CMP, typename B>
+bool RBTree<T,CMP,B>::bury(Node<T>* z){
+    if (!z) {
+        return false;
+    }
+    shrink_bounds(z);
+    z->dead = true;
+    ++tombstones;
+    --live;
+    bloom_forget();
+    if (tombstones > extras->tombstone_threshold * (live + tombstones)) {
+        compact_tombstones();
+    }
+    return true;
+}
+
+template <typename T, typename CMP, typename B>
+void RBTree<T,CMP,B>::set_lazy_delete(bool enable, double threshold){
+    if (enable || extras) {
+        extra().lazy_delete = enable;
+        extras->tombstone_threshold = threshold;
+    }
+    if (!enable && tombstones) {
+        compact_tombstones();
+    }
+}
+
+template <typename T, typename CMP, typename B>
+std::size_t RBTree<T,CMP,B>::compact_tombstones(){
+    std::vector<Node<T>*> order;
+    order.reserve(live + tombstones);
+    for (Node<T>* x = minimum_in_subtree(root.get()); x; x = successor(x)) {
+        order.push_back(x);
+    }
+    // Unlink everything, then free the tombstones one by one:
+    if (auto cache = hot_cache()) {
+        cache->clear();
+    }
+    root.release();
+    std::vector<std::unique_ptr<Node<T>>> nodes;
+    nodes.reserve(live);
+    std::size_t freed = 0;
+    for (auto x : order) {
+        x->children[0].release();
+        x->children[1].release();
+        x->parent = nullptr;
+        if (x->dead) {
+            delete x;
+            ++freed;
+        } else {
+            nodes.emplace_back(x);
+        }
+    }
+    link_balanced(nodes, 0);
+    return freed * sizeof(Node<T>);
+}
+
+template <typename T, typename CMP, typename B>
+template <typename It>
+void RBTree<T,CMP,B>::build_parallel(It first, It last, unsigned threads){
+    threads = std::max(threads, 1u);
+    std::vector<T> keys(first, last);
+    parallel_sort(keys, threads, cmp);
+    keys.erase(std::unique(keys.begin(), keys.end(),
+                           [this](const T& a, const T& b) { return !cmp(a, b) && !cmp(b, a); }),
+               keys.end());
+    std::vector<std::unique_ptr<Node<T>>> nodes(keys.size());
+    parallel_chunks(keys.size(), threads, [&](std::size_t lo, std::size_t hi) {
+        for (auto i = lo; i < hi; ++i) {
+            nodes[i] = std::make_unique<Node<T>>(std::move(keys[i]));
+        }
+    });
+    if (auto cache = hot_cache()) {
+        cache->clear();
+    }
+    root.reset();
+    // One subtree per thread, but no more than the pool can run at once:
+    const unsigned leaves = std::min(threads, static_cast<unsigned>(default_pool().size()) + 1);
+    int fork_depth = 0;
+    while ((1u << fork_depth) < leaves) {
+        ++fork_depth;
+    }
+    link_balanced(nodes, fork_depth);
+}
+
+template <typename T, typename CMP, typename B>
+void RBTree<T,CMP,B>::link_balanced(std::vector<std::unique_ptr<Node<T>>>& nodes, int fork_depth){
+    int red_depth = 0;
+    while ((std::size_t{2} << red_depth) <= nodes.size()) {
+        ++red_depth;
+    }
+    live = nodes.size();
+    tombstones = 0;
+    root = build_balanced(nodes, 0, nodes.size(), nullptr, 0, red_depth,
+                          fork_depth, fork_depth > 0 ? &default_pool() : nullptr);
+    B::rebuild_fixup(*this);
+    leftmost = minimum_in_subtree(root.get());
+    rightmost = maximum_in_subtree(root.get());
+    if (bloom()) {
+        rebuild_bloom();
+    }
+}
+
+template <typename T, typename CMP, typename B>
+std::unique_ptr<Node<T>> RBTree<T,CMP,B>::build_balanced(std::vector<std::unique_ptr<Node<T>>>& nodes,
+        std::size_t lo, std::size_t hi, Node<T>* parent, int depth, int red_depth,
+        int fork_depth, Work_stealing_pool* pool){
+    if (lo == hi) {
+        return nullptr;
+    }
+    auto mid = lo + (hi - lo) / 2;
+    auto x = std::move(nodes[mid]);
+    x->parent = parent;
+    if (fork_depth > 0) {
+        Task_group left{*pool};
+        left.spawn([&] {
+            x->children[0] = build_balanced(nodes, lo, mid, x.get(), depth + 1, red_depth, fork_depth - 1, pool);
+        });
+        x->children[1] = build_balanced(nodes, mid + 1, hi, x.get(), depth + 1, red_depth, fork_depth - 1, pool);
+        left.wait();
+    } else {
+        x->children[0] = build_balanced(nodes, lo, mid, x.get(), depth + 1, red_depth);
+        x->children[1] = build_balanced(nodes, mid + 1, hi, x.get(), depth + 1, red_depth);
+    }
+    // Every level above red_depth is full, so only the last one can be red:
+    x->color = depth == red_depth && depth > 0 ? Color::red : Color::black;
+    x->rank = static_cast<std::uint8_t>(1 + std::max(x->children[0] ? x->children[0]->rank : -1,
+                                                     x->children[1] ? x->children[1]->rank : -1));
+    return x;
+}
+
+template <typename T, typename CMP, typename B>
+template <typename Open, typename Middle, typename Close, typename Empty>
+void RBTree<T,CMP,B>::euler_walk(Open open, Middle middle, Close close, Empty empty) const{
+    // Climbing from a left child resumes at middle(), from a right child at close():
+    enum class Step {down, from_left, from_right};
+    const Node<T>* x = root.get();
+    Step step = Step::down;
+    while (x) {
+        if (step == Step::down) {
+            open(x);
+            if (x->children[0]) {
+                x = x->children[0].get();
+                continue;
+            }
+            empty();
+            step = Step::from_left;
+        }
+        if (step == Step::from_left) {
+            middle(x);
+            if (x->children[1]) {
+                x = x->children[1].get();
+                step = Step::down;
+                continue;
+            }
+            empty();
+        }
+        close(x);
+        step = x->is_right_child() ? Step::from_right : Step::from_left;
+        x = x->parent;
+    }
+}
+
+template <typename T, typename CMP, typename B>
+template <typename F>
+void RBTree<T,CMP,B>::walk_subtree(const Node<T>* x, F&& f){
+    std::vector<const Node<T>*> stack;
+    while (x || !stack.empty()) {
+        for (; x; x = x->children[0].get()) {
+            stack.push_back(x);
+        }
+        x = stack.back();
+        stack.pop_back();
+        if (!x->dead) {
+            f(x->key);
+        }
+        x = x->children[1].get();
+    }
+}
+
+template <typename T, typename CMP, typename B>
+template <typename F>
+void RBTree<T,CMP,B>::for_each_subtree(const Node<T>* x, F& f, int depth, int split_depth,
+                                       Work_stealing_pool& pool) const{
+    if (!x) {
+        return;
+    }
+    if (depth >= split_depth) {
+        walk_subtree(x, f);
+        return;
+    }
+    Task_group left{pool};
+    left.spawn([&, x] { for_each_subtree(x->children[0].get(), f, depth + 1, split_depth, pool); });
+    if (!x->dead) {
+        f(x->key);
+    }
+    for_each_subtree(x->children[1].get(), f, depth + 1, split_depth, pool);
+    left.wait();
+}
+
+template <typename T, typename CMP, typename B>
+template <typename R, typename Fold, typename Combine>
+R RBTree<T,CMP,B>::reduce_subtree(const Node<T>* x, const R& init, Fold& fold, Combine& combine,
+                                  int depth, int split_depth, Work_stealing_pool& pool) const{
+    if (!x) {
+        return init;
+    }
+    if (depth >= split_depth) {
+        R r = init;
+        walk_subtree(x, [&](const T& key) { r = fold(std::move(r), key); });
+        return r;
+    }
+    R l = init;
+    Task_group left{pool};
+    left.spawn([&, x] { l = reduce_subtree(x->children[0].get(), init, fold, combine, depth + 1, split_depth, pool); });
+    R m = x->dead ? init : fold(R(init), x->key);
+    R r = reduce_subtree(x->children[1].get(), init, fold, combine, depth + 1, split_depth, pool);
+    left.wait();
+    return combine(combine(std::move(l), std::move(m)), std::move(r));
+}
+
+template <typename T, typename CMP, typename B>
+void RBTree<T,CMP,B>::export_to(Export_format format, std::function<void(const char*, std::size_t)> sink) const{
+    Export_buffer out{std::move(sink)};
+    auto nothing = [](const Node<T>*) {};
+    switch (format) {
+    case Export_format::keys:
+        for (auto it = begin(); it != end(); ++it) {
+            export_key(out, *it, Key_escape::line);
+            out.put('\n');
+        }
+        break;
+    case Export_format::dot: {
+        // Nodes are named by their pre-order number, edges are emitted on entry:
+        std::vector<std::size_t> ids; // ids of the ancestors of the current node
+        std::size_t next = 0;
+        out.put("digraph RBTree {\n");
+        euler_walk([&](const Node<T>* x) {
+            ids.push_back(next++);
+            out.put("  n");
+            out.put_number(ids.back());
+            out.put(" [label=");
+            export_key(out, x->key, Key_escape::dot);
+            out.put(x->color == Color::red ? ", color=red" : "");
+            out.put(x->dead ? ", style=dashed" : "");
+            out.put("];\n");
+            if (ids.size() > 1) {
+                out.put("  n");
+                out.put_number(ids[ids.size() - 2]);
+                out.put(" -> n");
+                out.put_number(ids.back());
+                out.put(";\n");
+            }
+        }, nothing, [&](const Node<T>*) { ids.pop_back(); }, [] {});
+        out.put("}\n");
+        break;
+    }
+    case Export_format::json:
+        if (!root) {
+            out.put("null");
+        }
+        euler_walk([&](const Node<T>* x) {
+            out.put("{\"key\":");
+            export_key(out, x->key, Key_escape::json);
+            out.put(x->color == Color::red ? ",\"color\":\"red\"" : ",\"color\":\"black\"");
+            out.put(x->dead ? ",\"dead\":true" : "");
+            out.put(",\"left\":");
+        }, [&](const Node<T>*) { out.put(",\"right\":"); },
+           [&](const Node<T>*) { out.put('}'); }, [&] { out.put("null"); });
+        out.put('\n');
+        break;
+    }
+    out.flush();
+}
+
+template <typename T, typename CMP, typename B>
+int RBTree<T,CMP,B>::black_height() const {
+    int h = 0;
+    for (const Node<T>* x = root.get(); x; x = x->children[0].get()) {
+        h += x->color == Color::black;
+    }
+    return h;
+}
+
+template <typename T, typename CMP, typename B>
+int RBTree<T,CMP,B>::join(int bh, std::unique_ptr<Node<T>> x, std::unique_ptr<Node<T>> r, int rbh, side s) {
+    if (r && r->color == Color::red) {
+        r->color = Color::black;
+        ++rbh;
+    }
+    if (rbh > bh) {
+        // x goes into the taller tree: make it the one in root
+        std::swap(root, r);
+        std::swap(bh, rbh);
+        s = get_reverse_side(s);
+    }
+    // Walk down side s to the first black node (or missing child) of black height rbh:
+    Node<T>* p = nullptr;
+    Node<T>* y = root.get();
+    for (int h = bh; h > rbh || (y && y->color == Color::red); y = y->child(s).get()) {
+        h -= y->color == Color::black;
+        p = y;
+    }
+    auto& link = p ? p->child(s) : root;
+    x->color = Color::red;
+    x->parent = p;
+    x->child(get_reverse_side(s)) = std::move(link);
+    x->child(s) = std::move(r);
+    for (auto& c : x->children) {
+        if (c) {
+            c->parent = x.get();
+        }
+    }
+    Node<T>* z = x.get();
+    link = std::move(x);
+    B::insert_fixup(*this, z);
+    return black_height();
+}
+
+template <typename T, typename CMP, typename B>
+void RBTree<T,CMP,B>::reset_bounds() {
+    leftmost = extreme_in_subtree(root.get(), side::left);
+    if (leftmost && leftmost->dead) {
+        leftmost = next_live(leftmost);
+    }
+    rightmost = extreme_in_subtree(root.get(), side::right);
+    if (rightmost && rightmost->dead) {
+        rightmost = prev_live(rightmost);
+    }
+}
+
+template <typename T, typename CMP, typename B>
+template <typename Below>
+RBTree<T,CMP,B> RBTree<T,CMP,B>::split_while(Below below) {
+    static_assert(std::is_same<B, RB_balance>::value, "split_while joins trees by black height");
+    struct Piece {
+        std::unique_ptr<Node<T>> x;
+        std::unique_ptr<Node<T>> subtree;
+        int bh;
+    };
+    // Cut the search path for the split point: a node below it leaves with
+    // its left subtree, any other node stays with its right subtree.
+    std::vector<Piece> leaving, staying;
+    int bh = black_height();
+    auto x = std::move(root);
+    while (x) {
+        bh -= x->color == Color::black;
+        const side s = below(x->key) ? side::left : side::right;
+        auto subtree = std::move(x->child(s));
+        auto next = std::move(x->child(get_reverse_side(s)));
+        if (subtree) {
+            subtree->parent = nullptr;
+        }
+        if (next) {
+            next->parent = nullptr;
+        }
+        x->parent = nullptr;
+        (s == side::left ? leaving : staying).push_back({std::move(x), std::move(subtree), bh});
+        x = std::move(next);
+    }
+    // Join each side back from the pieces nearest to the split point up:
+    bh = 0;
+    for (auto it = staying.rbegin(); it != staying.rend(); ++it) {
+        bh = join(bh, std::move(it->x), std::move(it->subtree), it->bh, side::right);
+    }
+    RBTree prefix;
+    prefix.cmp = cmp;
+    if (lazy_deleting()) {
+        prefix.set_lazy_delete(true, extras->tombstone_threshold);
+    }
+    bh = 0;
+    for (auto it = leaving.rbegin(); it != leaving.rend(); ++it) {
+        bh = prefix.join(bh, std::move(it->x), std::move(it->subtree), it->bh, side::left);
+    }
+
+    std::size_t moved = 0;
+    std::size_t dead = 0;
+    std::vector<Node<T>*> stack;
+    if (prefix.root) {
+        stack.push_back(prefix.root.get());
+    }
+    while (!stack.empty()) {
+        Node<T>* y = stack.back();
+        stack.pop_back();
+        forget(y);
+        ++moved;
+        dead += y->dead;
+        for (const auto& c : y->children) {
+            if (c) {
+                stack.push_back(c.get());
+            }
+        }
+    }
+    prefix.live = moved - dead;
+    prefix.tombstones = dead;
+    live -= moved - dead;
+    tombstones -= dead;
+    reset_bounds();
+    prefix.reset_bounds();
+    bloom_forget(moved - dead);
+    return prefix;
+}
+
+template <typename T, typename CMP, typename B>
+void RBTree<T,CMP,B>::veb_order(Node<T>* x, int levels, std::vector<Node<T>*>& out) {
+    if (!x) {
+        return;
+    }
+    if (levels == 1) {
+        out.push_back(x);
+        return;
+    }
+    const int top = levels / 2;
+    veb_order(x, top, out);
+    // the bottom trees hang `top` levels below x
+    std::vector<Node<T>*> level{x}, next;
+    for (int d = 0; d < top; ++d) {
+        next.clear();
+        for (Node<T>* y : level) {
+            for (const auto& c : y->children) {
+                if (c) {
+                    next.push_back(c.get());
+                }
+            }
+        }
+        level.swap(next);
+    }
+    for (Node<T>* y : level) {
+        veb_order(y, levels - top, out);
+    }
+}
+
+template <typename T, typename CMP, typename B>
+std::vector<Node<T>*> RBTree<T,CMP,B>::nodes_in(Node_order order) const {
+    std::vector<Node<T>*> nodes;
+    std::vector<std::pair<Node<T>*, int>> stack;
+    int levels = 0;
+    Node<T>* x = root.get();
+    int depth = 1;
+    while (x || !stack.empty()) {
+        for (; x; x = x->children[0].get(), ++depth) {
+            stack.emplace_back(x, depth);
+        }
+        std::tie(x, depth) = stack.back();
+        stack.pop_back();
+        nodes.push_back(x);
+        levels = std::max(levels, depth);
+        x = x->children[1].get();
+        ++depth;
+    }
+    if (order == Node_order::van_emde_boas) {
+        std::size_t n = nodes.size();
+        nodes.clear();
+        nodes.reserve(n);
+        veb_order(root.get(), levels, nodes);
+    }
+    return nodes;
+}
+
+template <typename T, typename CMP, typename B>
+Memory_usage RBTree<T,CMP,B>::memory_usage() const {
+    Memory_usage m;
+    m.node_bytes = sizeof(Node<T>);
+    std::vector<std::uintptr_t> pages;
+    std::vector<const Node_block<T>*> blocks;
+    for (const Node<T>* x : nodes_in(Node_order::in_order)) {
+        ++m.nodes;
+        auto a = reinterpret_cast<std::uintptr_t>(x);
+        for (auto p = a >> 12; p <= (a + sizeof(Node<T>) - 1) >> 12; ++p) {
+            pages.push_back(p);
+        }
+        if (x->pooled) {
+            blocks.push_back(Node_block<T>::of(x));
+        } else {
+            // the allocator keeps a size word in front of each chunk
+#ifdef __linux__
+            m.allocated += malloc_usable_size(const_cast<Node<T>*>(x)) + sizeof(std::size_t);
+#else
+            m.allocated += (sizeof(Node<T>) + 15) / 16 * 16 + sizeof(std::size_t);
+#endif
+        }
+    }
+    std::sort(pages.begin(), pages.end());
+    m.pages = static_cast<std::size_t>(std::unique(pages.begin(), pages.end()) - pages.begin());
+    std::sort(blocks.begin(), blocks.end());
+    m.allocated += static_cast<std::size_t>(std::unique(blocks.begin(), blocks.end()) - blocks.begin())
+                   * Node_block<T>::bytes;
+    m.slack = m.allocated - m.nodes * m.node_bytes;
+    if (m.pages) {
+        const std::size_t packed = (m.nodes * m.node_bytes + 4095) / 4096;
+        m.fragmentation = 1.0 - static_cast<double>(packed) / m.pages;
+    }
+    return m;
+}
+
+// Each old node forwards to its copy through its parent link, whose old
+// value the copy keeps until every link has been translated.
+template <typename T, typename CMP, typename B>
+void RBTree<T,CMP,B>::compact(Node_order order) {
+    std::vector<Node<T>*> old = nodes_in(order);
+    std::vector<Node<T>*> moved(old.size());
+    for (std::size_t i = 0; i < old.size(); i += Node_block<T>::capacity) {
+        const std::size_t n = std::min(Node_block<T>::capacity, old.size() - i);
+        Node<T>* slots = Node_block<T>::allocate(n);
+        for (std::size_t j = 0; j < n; ++j) {
+            Node<T>* x = old[i + j];
+            Node<T>* y = ::new (slots + j) Node<T>{std::move(x->key)};
+            y->color = x->color;
+            y->rank = x->rank;
+            y->dead = x->dead;
+            y->pooled = true;
+            y->parent = x->parent;
+            x->parent = y;
+            moved[i + j] = y;
+        }
+    }
+    for (std::size_t i = 0; i < old.size(); ++i) {
+        Node<T>* y = moved[i];
+        if (y->parent) {
+            y->parent = y->parent->parent;
+        }
+        for (int c = 0; c < 2; ++c) {
+            if (Node<T>* child = old[i]->children[c].release()) {
+                y->children[c].reset(child->parent);
+            }
+        }
+    }
+    auto forward = [](Node<T>* x) { return x ? x->parent : nullptr; };
+    leftmost = forward(leftmost);
+    rightmost = forward(rightmost);
+    if (auto cache = hot_cache()) {
+        cache->remap(forward);
+    }
+    Node<T>* top = root.release();
+    root.reset(forward(top));
+    for (Node<T>* x : old) {
+        delete x;
+    }
+}
+
+template <typename T, typename CMP, typename B>
+Node_handle<T> RBTree<T,CMP,B>::extract(_iterator it) {
+    Node<T>* z = it.get();
+    if (!z || z->dead) {
+        return Node_handle<T>{};
+    }
+    return Node_handle<T>{unlink(z)};
+}
+
+template <typename T, typename CMP, typename B>
+typename RBTree<T,CMP,B>::Insert_result RBTree<T,CMP,B>::insert(Node_handle<T>&& nh) {
+    if (nh.empty()) {
+        return {end(), false, Node_handle<T>{}};
+    }
+    Node<T>* z = nh.node.get();
+    z->color = Color::red;
+    z->rank = 0;
+    z->dead = false;
+    z->set_prefix(z->key);
+    Node<T>* x = insert(std::move(nh.node));
+    if (!x) {
+        return {find(z->key), false, std::move(nh)};
+    }
+    nh.node.reset(); // the key came back from a tombstone: the node is not needed
+    return {_iterator{x}, true, Node_handle<T>{}};
+}
+
+template <typename T, typename CMP, typename B>
+template <typename B2>
+void RBTree<T,CMP,B>::merge(RBTree<T, CMP, B2>& other) {
+    Node<T>* x = other.leftmost;
+    while (x) {
+        Node<T>* next = other.next_live(x);
+        Node<T>* here = search_subtree(root.get(), x->key);
+        if (!here || here->dead) {
+            insert(Node_handle<T>{other.unlink(x)});
+        }
+        x = next;
+    }
+}
+
+template <typename T, typename CMP, typename B>
+typename RBTree<T,CMP,B>::_iterator RBTree<T,CMP,B>::erase(_iterator it) {
+    Node<T>* z = it.get();
+    _iterator next{next_live(z)};
+    if (lazy_deleting()) {
+        bury(z);
+    } else {
+        Delete(z);
+    }
+    return next;
+}
+
+///////////////////////// BALANCING POLICIES IMPLEMENTATION /////////////////////////
+template <typename Tree, typename N>
+void RB_balance::insert_fixup(Tree& t, N* z){
+    auto zp = z->parent;
+    while (is_red(zp)) {
+        auto zpp = zp->parent;
+        // s is the side of zp under zpp, o the side of the uncle:
+        const side s = zp->get_side();
+        const side o = get_reverse_side(s);
+        auto y = zpp->child(o).get();
+        if (is_red(y)) {
+            zp->color = Color::black;
+            y->color = Color::black;
+            zpp->color = Color::red;
+            z = zpp;
+            zp = z->parent;
+        } else {
+            if (z == zp->child(o).get()) {
+                t.rotate(std::move(zpp->child(s)), s);
+                z = zp;
+                zp = zpp->child(s).get();
+            }
+            zp->color = Color::black;
+            zpp->color = Color::red;
+            t.rotate(std::move(t.link_of(zpp)), o);
+        }
+    }
+    t.root->color = Color::black;
+}
+
+template <typename Tree, typename N>
+void RB_balance::delete_fixup(Tree& t, N* x, N* xp, Color removed){
+    if (removed != Color::black) {
+        return;
+    }
+    while (x != t.root.get() && !is_red(x)) {
+        // s is the side of x under xp (x may be nullptr), o the side of its sibling w:
+        const side s = x == xp->child(side::left).get() ? side::left : side::right;
+        const side o = get_reverse_side(s);
+        N* w = xp->child(o).get();
+        if (is_red(w)) {
+            w->color = Color::black;
+            xp->color = Color::red;
+            t.rotate(std::move(t.link_of(xp)), s);
+            w = xp->child(o).get();
+        }
+        if (w && !is_red(w->child(s).get()) && !is_red(w->child(o).get())) {
+            w->color = Color::red;
+            x = xp;
+            xp = xp->parent;
+        } else if (w) {
+            if (!is_red(w->child(o).get())) {
+                w->child(s)->color = Color::black;
+                w->color = Color::red;
+                t.rotate(std::move(t.link_of(w)), o);
+                w = xp->child(o).get();
+            }
+            w->color = xp->color;
+            xp->color = Color::black;
+            w->child(o)->color = Color::black;
+            t.rotate(std::move(t.link_of(xp)), s);
+            x = t.root.get();
+        } else {
+            x = t.root.get();
+        }
+    }
+    if (x) {
+        x->color = Color::black;
+    }
+}
+
+template <typename Tree, typename N>
+N* AVL_balance::rebalance(Tree& t, N* x){
+    int balance = rank(x->child(side::left).get()) - rank(x->child(side::right).get());
+    if (balance > 1 || balance < -1) {
+        // s is the heavy side; a zig-zag needs a rotation of the child first
+        const side s = balance > 1 ? side::left : side::right;
+        const side o = get_reverse_side(s);
+        N* c = x->child(s).get();
+        if (rank(c->child(s).get()) < rank(c->child(o).get())) {
+            t.rotate(std::move(x->child(s)), s);
+            update(c);
+        }
+        t.rotate(std::move(t.link_of(x)), o);
+        update(x);
+        x = x->parent;
+    }
+    update(x);
+    return x;
+}
+
+template <typename Tree, typename N>
+void AVL_balance::insert_fixup(Tree& t, N* z){
+    for (N* x = z->parent; x; x = x->parent) {
+        int before = x->rank;
+        x = rebalance(t, x);
+        if (x->rank == before) {
+            break;
+        }
+    }
+}
+
+template <typename Tree, typename N>
+void AVL_balance::delete_fixup(Tree& t, N*, N* xp, Color){
+    for (N* x = xp; x; x = x->parent) {
+        int before = x->rank;
+        x = rebalance(t, x);
+        if (x->rank == before) {
+            break;
+        }
+    }
+}
+
+template <typename Tree, typename N>
+void WAVL_balance::insert_fixup(Tree& t, N* z){
+    N* x = z;
+    N* p = x->parent;
+    // x is a 0-child of p: promote p while its other child is a 1-child
+    while (p && rank(p) == rank(x)) {
+        const side s = x->get_side();
+        const side o = get_reverse_side(s);
+        if (rank(p) - rank(p->child(o).get()) == 1) {
+            ++p->rank;
+            x = p;
+            p = x->parent;
+            continue;
+        }
+        // p is a 0,2 node: one or two rotations end the rebalancing
+        N* y = x->child(o).get();
+        if (!y || rank(x) - rank(y) == 2) {
+            t.rotate(std::move(t.link_of(p)), o);
+            --p->rank;
+        } else {
+            t.rotate(std::move(p->child(s)), s);
+            t.rotate(std::move(t.link_of(p)), o);
+            ++y->rank;
+            --x->rank;
+            --p->rank;
+        }
+        break;
+    }
+}
+
+template <typename Tree, typename N>
+void WAVL_balance::delete_fixup(Tree& t, N* x, N* xp, Color){
+    N* p = xp;
+    if (p && !x && p->is_leaf() && p->rank == 1) {
+        // p became a 2,2 leaf
+        p->rank = 0;
+        x = p;
+        p = x->parent;
+    }
+    // x is a 3-child of p: demote p, or p and its sibling, or rotate
+    while (p && rank(p) - rank(x) == 3) {
+        const side s = x == p->child(side::left).get() ? side::left : side::right;
+        const side o = get_reverse_side(s);
+        N* y = p->child(o).get();
+        if (rank(p) - rank(y) == 2) {
+            --p->rank;
+            x = p;
+            p = x->parent;
+            continue;
+        }
+        if (rank(y) - rank(y->children[0].get()) == 2 && rank(y) - rank(y->children[1].get()) == 2) {
+            --p->rank;
+            --y->rank;
+            x = p;
+            p = x->parent;
+            continue;
+        }
+        N* outer = y->child(o).get();
+        N* inner = y->child(s).get();
+        if (rank(y) - rank(outer) == 1) {
+            t.rotate(std::move(t.link_of(p)), s);
+            ++y->rank;
+            --p->rank;
+            if (p->is_leaf()) {
+                --p->rank;
+            }
+        } else {
+            t.rotate(std::move(p->child(o)), o);
+            t.rotate(std::move(t.link_of(p)), s);
+            inner->rank += 2;
+            --y->rank;
+            p->rank -= 2;
+        }
+        break;
+    }
+}
+
+template <typename Tree, typename N>
+N* LLRB_balance::normalize(Tree& t, N* h){
+    N* l = h->child(side::left).get();
+    N* r = h->child(side::right).get();
+    if (is_red(r) && !is_red(l)) {
+        t.rotate(std::move(t.link_of(h)), side::left);
+        r->color = h->color;
+        h->color = Color::red;
+        h = r;
+        l = h->child(side::left).get();
+        r = h->child(side::right).get();
+    }
+    if (is_red(l) && is_red(l->child(side::left).get())) {
+        t.rotate(std::move(t.link_of(h)), side::right);
+        l->color = h->color;
+        h->color = Color::red;
+        h = l;
+        l = h->child(side::left).get();
+        r = h->child(side::right).get();
+    }
+    if (is_red(l) && is_red(r)) {
+        h->color = Color::red;
+        l->color = Color::black;
+        r->color = Color::black;
+    }
+    return h;
+}
+
+template <typename Tree, typename N>
+void LLRB_balance::insert_fixup(Tree& t, N* z){
+    for (N* h = z->parent; h; h = h->parent) {
+        h = normalize(t, h);
+    }
+    t.root->color = Color::black;
+}
+
+template <typename Tree, typename N>
+void LLRB_balance::normalize_subtree(Tree& t, N* h){
+    for (const auto& c : h->children) {
+        if (c) {
+            normalize_subtree(t, c.get());
+        }
+    }
+    normalize(t, h);
+}
+
+template <typename Tree>
+void LLRB_balance::rebuild_fixup(Tree& t){
+    if (t.root) {
+        normalize_subtree(t, t.root.get());
+        t.root->color = Color::black;
+    }
+}
+
+template <typename Tree, typename N>
+void LLRB_balance::delete_fixup(Tree& t, N* x, N* xp, Color removed){
+    RB_balance::delete_fixup(t, x, xp, removed);
+    // The classic fixup only touched xp's path and the siblings hanging off it:
+    for (N* h = xp; h; h = h->parent) {
+        for (const auto& c : h->children) {
+            if (c) {
+                normalize(t, c.get());
+            }
+        }
+        h = normalize(t, h);
+    }
+    if (t.root) {
+        t.root->color = Color::black;
+    }
+}
+
+
+// USEFUL FUNCTIONS TO PRINT RBTree:
+template <typename T>
+std::ostream& operator<<(std::ostream& os, Node<T>* node) {
+    // in-order walk of the subtree with an explicit stack, through a buffer
+    Export_buffer out{[&os](const char* s, std::size_t n) { os.write(s, static_cast<std::streamsize>(n)); }};
+    std::vector<Node<T>*> stack;
+    while (node || !stack.empty()) {
+        for (; node; node = node->children[0].get()) {
+            stack.push_back(node);
+        }
+        node = stack.back();
+        stack.pop_back();
+        if (!node->dead) {
+            export_key(out, node->key, Key_escape::none);
+            out.put(node->color == Color::black ? "● " : "○ ");
+        }
+        node = node->children[1].get();
+    }
+    out.flush();
+    return os;
+}
+
+template <typename T, typename CMP, typename B>
+std::ostream& operator<<(std::ostream& os, const RBTree<T,CMP,B>& tree) {
+    os << tree.root.get();
+    return os;
+}
+
+
+// RBTree ITERATOR:
+template <typename RBTree, typename T>
+const_iterator<RBTree,T>& const_iterator<RBTree,T>::operator++() {  // pre-increment ++i
+  // in-order successor, skipping the tombstones left by lazy deletion
+  do {
+    if (current->children[1]) {
+      current = current->children[1].get();
+      while (current->children[0]) {
+        current = current->children[0].get();
+      }
+    } else {
+      while (current->parent && current->is_right_child()) {
+        current = current->parent;
+      }
+      current = current->parent;
+    }
+  } while (current && current->dead);
+  return *this;
+}
+
+template <typename RBTree, typename T>
+const_iterator<RBTree,T> const_iterator<RBTree,T>::operator++(int) {  // post-increment i++
+  auto tmp = *this;
+  ++(*this); // i++ is slower than ++i since it first return the copy and then increment it!
+  return tmp;
+}
+
+
+
+///////////////////////// TopDownRBTree IMPLEMENTATION /////////////////////////
+template <typename T, typename CMP>
+void TopDownRBTree<T,CMP>::rotate(Link& link, bool dir){
+    auto save = std::move(link->children[!dir]);
+    link->children[!dir] = std::move(save->children[dir]);
+    save->children[dir] = std::move(link);
+    link = std::move(save);
+    link->color = Color::black;
+    link->children[dir]->color = Color::red;
+}
+
+template <typename T, typename CMP>
+void TopDownRBTree<T,CMP>::rotate_twice(Link& link, bool dir){
+    rotate(link->children[!dir], !dir);
+    rotate(link, dir);
+}
+
+template <typename T, typename CMP>
+bool TopDownRBTree<T,CMP>::contains(const T& key) const{
+    TDNode<T>* x = root.get();
+    while (x) {
+        if (cmp(key, x->key)) {
+            x = x->children[0].get();
+        } else if (cmp(x->key, key)) {
+            x = x->children[1].get();
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename T, typename CMP>
+void TopDownRBTree<T,CMP>::insert(const T& key){
+    if (!root) {
+        root = std::make_unique<TDNode<T>>(key);
+        root->color = Color::black;
+        return;
+    }
+    // q walks down, p is its parent, g its grandparent and t the parent of g
+    // (nullptr stands for the virtual head above the root).
+    TDNode<T>* t = nullptr;
+    TDNode<T>* g = nullptr;
+    TDNode<T>* p = nullptr;
+    TDNode<T>* q = root.get();
+    bool dir = false;
+    bool last = false;
+    for (;;) {
+        if (!q) {
+            p->children[dir] = std::make_unique<TDNode<T>>(key);
+            q = p->children[dir].get();
+        } else if (is_red(q->children[0].get()) && is_red(q->children[1].get())) {
+            // split a 4-node on the way down
+            q->color = Color::red;
+            q->children[0]->color = Color::black;
+            q->children[1]->color = Color::black;
+        }
+        if (is_red(q) && is_red(p)) {
+            Link& gl = t ? t->children[t->children[1].get() == g] : root;
+            if (q == p->children[last].get()) {
+                rotate(gl, !last);
+            } else {
+                rotate_twice(gl, !last);
+            }
+        }
+        if (!cmp(key, q->key) && !cmp(q->key, key)) {
+            break;
+        }
+        last = dir;
+        dir = cmp(q->key, key);
+        if (g) {
+            t = g;
+        }
+        g = p;
+        p = q;
+        q = q->children[dir].get();
+    }
+    root->color = Color::black;
+}
+
+template <typename T, typename CMP>
+bool TopDownRBTree<T,CMP>::Delete(const T& key){
+    if (!root) {
+        return false;
+    }
+    // Push a red node down the search path so that the node finally
+    // unlinked is red. q_link/p_link are the links owning q and p.
+    Link* p_link = nullptr;
+    Link* q_link = nullptr;
+    Link* next = &root;
+    TDNode<T>* p = nullptr;
+    TDNode<T>* q = nullptr;
+    TDNode<T>* f = nullptr;
+    bool dir = true;
+    while (*next) {
+        bool last = dir;
+        p_link = q_link;
+        p = q;
+        q_link = next;
+        q = next->get();
+        dir = cmp(q->key, key);
+        if (!dir && !cmp(key, q->key)) {
+            f = q;
+        }
+        if (!is_red(q) && !is_red(q->children[dir].get())) {
+            if (is_red(q->children[!dir].get())) {
+                rotate(*q_link, dir);
+                p_link = q_link;
+                p = q_link->get();
+                q_link = &p->children[dir];
+            } else if (p) {
+                TDNode<T>* s = p->children[!last].get();
+                if (s) {
+                    if (!is_red(s->children[!last].get()) && !is_red(s->children[last].get())) {
+                        p->color = Color::black;
+                        s->color = Color::red;
+                        q->color = Color::red;
+                    } else {
+                        if (is_red(s->children[last].get())) {
+                            rotate_twice(*p_link, last);
+                        } else {
+                            rotate(*p_link, last);
+                        }
+                        TDNode<T>* r = p_link->get();
+                        q->color = Color::red;
+                        r->color = Color::red;
+                        r->children[0]->color = Color::black;
+                        r->children[1]->color = Color::black;
+                        p_link = &r->children[last];
+                    }
+                }
+            }
+        }
+        next = &q->children[dir];
+    }
+    if (f) {
+        if (f != q) {
+            f->key = std::move(q->key);
+        }
+        auto child = std::move(q->children[!q->children[0]]);
+        *q_link = std::move(child);
+    }
+    if (root) {
+        root->color = Color::black;
+    }
+    return f != nullptr;
+}
+
+
+///////////////////////// Work_stealing_pool IMPLEMENTATION /////////////////////////
+
+inline Work_stealing_pool::Work_stealing_pool(unsigned count){
+    for (unsigned i = 0; i <= count; ++i) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (unsigned i = 1; i <= count; ++i) {
+        workers.emplace_back([this, i] { work(i); });
+    }
+}
+
+inline Work_stealing_pool::~Work_stealing_pool(){
+    {
+        std::lock_guard<std::mutex> lk{idle_m};
+        stop = true;
+    }
+    idle.notify_all();
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+inline void Work_stealing_pool::submit(std::function<void()> task){
+    auto& q = *queues[own_queue()];
+    {
+        std::lock_guard<std::mutex> lk{q.m};
+        q.tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lk{idle_m};
+        ++queued;
+    }
+    idle.notify_one();
+}
+
+inline bool Work_stealing_pool::run_one(){
+    const std::size_t self = own_queue();
+    std::function<void()> task;
+    for (std::size_t k = 0; k < queues.size() && !task; ++k) {
+        auto& q = *queues[(self + k) % queues.size()];
+        std::lock_guard<std::mutex> lk{q.m};
+        if (q.tasks.empty()) {
+            continue;
+        }
+        if (k == 0) { // own queue: newest task, its data is still in cache
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        } else {      // steal the oldest, usually the biggest subtree
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+    }
+    if (!task) {
+        return false;
+    }
+    --queued;
+    task();
+    return true;
+}
+
+inline void Work_stealing_pool::work(std::size_t i){
+    current_pool = this;
+    current_queue = i;
+    for (;;) {
+        if (run_one()) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lk{idle_m};
+        idle.wait(lk, [this] { return stop || queued > 0; });
+        if (stop) {
+            return;
+        }
+    }
+}
+
+inline Work_stealing_pool& default_pool(){
+    static Work_stealing_pool pool{std::max(std::thread::hardware_concurrency(), 1u) - 1};
+    return pool;
+}
+
+///////////////////////// Chromatic_tree IMPLEMENTATION /////////////////////////
+
+inline Epoch_domain& Epoch_domain::instance() {
+    static Epoch_domain domain;
+    return domain;
+}
+
+inline Epoch_domain::~Epoch_domain() {
+    for (auto& r : orphans) r.free(r.p);
+    for (auto& s : slots)
+        for (auto& r : s.limbo) r.free(r.p);
+}
+
+// Slot of the calling thread, claimed on first use and given back (with the
+// nodes it still holds) when the thread exits.
+inline Epoch_domain::Slot& Epoch_domain::slot() {
+    struct Holder {
+        Epoch_domain* domain = nullptr;
+        Slot* s = nullptr;
+        ~Holder() { if (s) domain->release(*s); }
+    };
+    thread_local Holder h;
+    if (h.s) return *h.s;
+    for (std::size_t i = 0; i < max_threads; ++i) {
+        bool free = false;
+        if (slots[i].taken.compare_exchange_strong(free, true)) {
+            std::size_t n = claimed.load();
+            while (n <= i && !claimed.compare_exchange_weak(n, i + 1)) {}
+            h.domain = this;
+            h.s = &slots[i];
+            return slots[i];
+        }
+    }
+    throw std::runtime_error{"Epoch_domain: more than " + std::to_string(max_threads) + " threads"};
+}
+
+inline void Epoch_domain::release(Slot& s) {
+    {
+        std::lock_guard<std::mutex> g{orphans_m};
+        orphans.insert(orphans.end(), s.limbo.begin(), s.limbo.end());
+    }
+    s.limbo.clear();
+    s.depth = 0;
+    s.active.store(0);
+    s.taken.store(false);
+}
+
+inline void Epoch_domain::enter() {
+    Slot& s = slot();
+    if (s.depth++ == 0) s.active.store(epoch.load());
+}
+
+inline void Epoch_domain::leave() {
+    Slot& s = slot();
+    if (--s.depth == 0) s.active.store(0, std::memory_order_release);
+}
+
+// The epoch moves on only when every thread inside a critical section has
+// seen the current one.
+inline void Epoch_domain::try_advance() {
+    std::uint64_t e = epoch.load();
+    const std::size_t n = claimed.load();
+    for (std::size_t i = 0; i < n; ++i) {
+        std::uint64_t a = slots[i].active.load();
+        if (a != 0 && a != e) return;
+    }
+    epoch.compare_exchange_strong(e, e + 1);
+}
+
+inline void Epoch_domain::collect(std::vector<Retired>& list) {
+    std::uint64_t e = epoch.load();
+    auto keep = std::partition(list.begin(), list.end(), [e](const Retired& r){ return r.epoch + 2 > e; });
+    for (auto it = keep; it != list.end(); ++it) it->free(it->p);
+    list.erase(keep, list.end());
+}
+
+inline void Epoch_domain::retire(void* p, void (*free)(void*)) {
+    Slot& s = slot();
+    s.limbo.push_back({epoch.load(), p, free});
+    if (s.limbo.size() % 64 != 0) return;
+    try_advance();
+    collect(s.limbo);
+    std::unique_lock<std::mutex> g{orphans_m, std::try_to_lock};
+    if (g && !orphans.empty()) collect(orphans);
+}
+
+template <typename T, typename CMP>
+Chromatic_tree<T,CMP>::~Chromatic_tree() {
+    std::vector<N*> stack{entry};
+    while (!stack.empty()) {
+        N* x = stack.back();
+        stack.pop_back();
+        for (auto& c : x->children)
+            if (N* y = c.load()) stack.push_back(y);
+        delete x;
+    }
+}
+
+template <typename T, typename CMP>
+bool Chromatic_tree<T,CMP>::commit(N* owner, bool dir, std::initializer_list<Frozen> old, N* top, Change& change) {
+    N* locked[8];
+    std::size_t n = 0;
+    bool ok = owner->try_lock();
+    if (ok) {
+        locked[n++] = owner;
+        ok = !owner->removed.load() && owner->children[dir].load() == old.begin()->x;
+    }
+    for (const Frozen& f : old) {
+        if (!ok) break;
+        ok = f.x->try_lock();
+        if (!ok) break;
+        locked[n++] = f.x;
+        ok = !f.x->removed.load() && f.x->children[0].load() == f.c[0] && f.x->children[1].load() == f.c[1];
+    }
+    if (ok) {
+        owner->children[dir].store(top, std::memory_order_release);
+        for (const Frozen& f : old) f.x->removed.store(true);
+    }
+    while (n) locked[--n]->unlock();
+    if (!ok) {
+        for (std::size_t i = 0; i < change.count; ++i) delete change.fresh[i];
+        std::this_thread::yield();
+        return false;
+    }
+    for (const Frozen& f : old) Epoch_domain::instance().retire(f.x, free_node);
+    return true;
+}
+
+template <typename T, typename CMP>
+bool Chromatic_tree<T,CMP>::contains(const T& key) const {
+    Epoch_guard g;
+    // Internal nodes have both children and leaves none, so one load per
+    // level both finds the next node and tells a leaf apart:
+    N* x = entry->children[0].load(std::memory_order_acquire);
+    while (N* y = x->children[goes_right(key, x)].load(std::memory_order_acquire)) x = y;
+    return holds(x, key);
+}
+
+// The leaf l reached by key becomes an internal node with two leaves, the
+// old one and the new one, taking one unit of weight from l.
+template <typename T, typename CMP>
+bool Chromatic_tree<T,CMP>::insert(const T& key) {
+    Epoch_guard g;
+    for (;;) {
+        N* p = entry;
+        N* l = entry->children[0].load(std::memory_order_acquire);
+        while (N* y = l->children[goes_right(key, l)].load(std::memory_order_acquire)) {
+            p = l;
+            l = y;
+        }
+        if (holds(l, key)) return false;
+        Change change;
+        int w = p == entry ? 1 : l->weight - 1;
+        N* fresh = change.make(key, false, 1, nullptr, nullptr);
+        N* copy = change.make(l, 1, {nullptr, nullptr});
+        N* top = goes_right(key, l) ? change.make(key, false, w, copy, fresh)
+                                    : change.make(l->key, l->inf, w, fresh, copy);
+        if (commit(p, goes_right(key, p), {Frozen{l, {nullptr, nullptr}}}, top, change)) {
+            if (w > 1 || (w == 0 && p->weight == 0)) cleanup(key);
+            return true;
+        }
+    }
+}
+
+// The parent of the leaf is replaced by its other child, which takes the
+// weight of both.
+template <typename T, typename CMP>
+bool Chromatic_tree<T,CMP>::Delete(const T& key) {
+    Epoch_guard g;
+    for (;;) {
+        N* gp = nullptr;
+        N* p = entry;
+        N* l = entry->children[0].load(std::memory_order_acquire);
+        while (N* y = l->children[goes_right(key, l)].load(std::memory_order_acquire)) {
+            gp = p;
+            p = l;
+            l = y;
+        }
+        if (!holds(l, key)) return false;
+        Frozen fp = read(p);
+        bool dir = goes_right(key, p);
+        if (fp.c[dir] != l) continue;
+        Frozen fs = read(fp.c[!dir]);
+        Change change;
+        int w = gp == entry ? 1 : p->weight + fs.x->weight;
+        N* top = change.make(fs.x, w, {fs.c[0], fs.c[1]});
+        if (commit(gp, goes_right(key, gp), {fp, Frozen{l, {nullptr, nullptr}}, fs}, top, change)) {
+            if (gp != entry && (w > 1 || (w == 0 && gp->weight == 0))) cleanup(key);
+            return true;
+        }
+    }
+}
+
+// Walk down to key and fix the first violation met, until a walk reaches the
+// leaf without meeting any. The root has no violation of its own: its weight
+// does not matter for balance. A fix that fails found its nodes changed by
+// another update since the walk read them, so the next walk sees new nodes;
+// a state that no update could have produced throws instead.
+template <typename T, typename CMP>
+void Chromatic_tree<T,CMP>::cleanup(const T& key) {
+    std::vector<N*> path;
+    for (;;) {
+        path.assign(1, entry);
+        N* x = entry->children[0].load(std::memory_order_acquire);
+        for (;;) {
+            path.push_back(x);
+            std::size_t i = path.size() - 1;
+            N* p = path[i - 1];
+            if (p != entry && x->weight > 1) {
+                N* y = p->children[p->children[0].load() == x].load(std::memory_order_acquire);
+                if (p->weight == 0 && y->weight == 0) {
+                    // The red sibling of x sits under a red parent: fix that first.
+                    if (path[i - 2] == entry) fix_red_root(p);
+                    else fix_red_red(path[i - 3], path[i - 2], p, y);
+                }
+                else fix_overweight(path[i - 2], p, x);
+                break;
+            }
+            if (p != entry && x->weight == 0 && p->weight == 0) {
+                if (path[i - 2] == entry) fix_red_root(p);
+                else fix_red_red(path[i - 3], path[i - 2], p, x);
+                break;
+            }
+            if (x->is_leaf()) return;
+            x = x->children[goes_right(key, x)].load(std::memory_order_acquire);
+        }
+    }
+}
+
+template <typename T, typename CMP>
+bool Chromatic_tree<T,CMP>::fix_red_root(N* root) {
+    Frozen fr = read(root);
+    Change change;
+    N* top = change.make(root, 1, {fr.c[0], fr.c[1]});
+    return commit(entry, 0, {fr}, top, change);
+}
+
+// With u black (the first violation of the path is at x), a red uncle turns
+// the pair red into a pair black below a lighter u (BLK); otherwise a single
+// (RB1) or double (RB2) rotation removes the violation.
+template <typename T, typename CMP>
+bool Chromatic_tree<T,CMP>::fix_red_red(N* o, N* u, N* p, N* x) {
+    Frozen fu = read(u), fp = read(p);
+    N* oc = o->children[1].load();
+    bool du = oc == u;
+    if ((!du && o->children[0].load() != u) || (fu.c[0] != p && fu.c[1] != p) || (fp.c[0] != x && fp.c[1] != x))
+        return false;
+    if (u->weight == 0 || p->weight != 0 || x->weight != 0) return false;
+    bool dp = fu.c[1] == p, dx = fp.c[1] == x;
+    N* y = fu.c[!dp];
+    Change change;
+    if (y->weight == 0) {
+        Frozen fy = read(y);
+        N* p2 = change.make(p, 1, {fp.c[0], fp.c[1]});
+        N* y2 = change.make(y, 1, {fy.c[0], fy.c[1]});
+        return commit(o, du, {fu, fp, fy}, change.make(u, u->weight - 1, order(dp, p2, y2)), change);
+    }
+    if (dx == dp) {
+        N* m = change.make(u, 0, order(dp, fp.c[!dp], y));
+        return commit(o, du, {fu, fp}, change.make(p, u->weight, order(dp, x, m)), change);
+    }
+    Frozen fx = read(x);
+    N* p2 = change.make(p, 0, order(dp, fp.c[dp], fx.c[dp]));
+    N* u2 = change.make(u, 0, order(dp, fx.c[!dp], y));
+    return commit(o, du, {fu, fp, fx}, change.make(x, u->weight, order(dp, p2, u2)), change);
+}
+
+// Classic deletion cases with weights: a red sibling y is rotated above u;
+// a black sibling without red children (or an overweight one) takes the
+// extra weight up to u with x (PUSH); otherwise a single or double rotation
+// hands one unit of the weight of x to a red nephew.
+template <typename T, typename CMP>
+bool Chromatic_tree<T,CMP>::fix_overweight(N* o, N* u, N* x) {
+    Frozen fu = read(u);
+    bool du = o->children[1].load() == u;
+    if ((!du && o->children[0].load() != u) || (fu.c[0] != x && fu.c[1] != x) || x->weight <= 1) return false;
+    bool dx = fu.c[1] == x;
+    Frozen fx = read(x), fy = read(fu.c[!dx]);
+    N* y = fy.x;
+    Change change;
+    if (y->weight == 0) {
+        if (u->weight == 0) return false;
+        N* m = change.make(u, 0, order(dx, x, fy.c[dx]));
+        return commit(o, du, {fu, fy}, change.make(y, u->weight, order(dx, m, fy.c[!dx])), change);
+    }
+    N* near = fy.c[dx];
+    N* far = fy.c[!dx];
+    if (y->weight == 1 && !near) {
+        // Every commit keeps the weight of each path below a link, so x and y,
+        // both read as children of u, cannot disagree: the tree is corrupt.
+        // Retrying would walk back here forever.
+        throw std::logic_error{"Chromatic_tree: sibling paths of unequal weight"};
+    }
+    N* x2 = change.make(x, x->weight - 1, {fx.c[0], fx.c[1]});
+    if (y->weight > 1 || !near || (near->weight > 0 && far->weight > 0)) {
+        N* y2 = change.make(y, y->weight - 1, {fy.c[0], fy.c[1]});
+        return commit(o, du, {fu, fx, fy}, change.make(u, u->weight + 1, order(dx, x2, y2)), change);
+    }
+    if (far->weight == 0) {
+        Frozen ff = read(far);
+        N* m = change.make(u, 1, order(dx, x2, near));
+        N* f2 = change.make(far, 1, {ff.c[0], ff.c[1]});
+        return commit(o, du, {fu, fx, fy, ff}, change.make(y, u->weight, order(dx, m, f2)), change);
+    }
+    Frozen fn = read(near);
+    N* m = change.make(u, 1, order(dx, x2, fn.c[dx]));
+    N* y2 = change.make(y, 1, order(dx, fn.c[!dx], far));
+    return commit(o, du, {fu, fx, fy, fn}, change.make(near, u->weight, order(dx, m, y2)), change);
+}
+
+template <typename T, typename CMP>
+std::size_t Chromatic_tree<T,CMP>::size() const {
+    std::size_t n = 0;
+    std::vector<const N*> stack{entry->children[0].load()};
+    while (!stack.empty()) {
+        const N* x = stack.back();
+        stack.pop_back();
+        if (x->is_leaf()) n += !x->inf;
+        else for (auto& c : x->children) stack.push_back(c.load());
+    }
+    return n;
+}
+
+template <typename T, typename CMP>
+std::size_t Chromatic_tree<T,CMP>::violations() const {
+    std::size_t n = 0;
+    std::vector<const N*> stack{entry->children[0].load()};
+    while (!stack.empty()) {
+        const N* x = stack.back();
+        stack.pop_back();
+        if (x->is_leaf()) continue;
+        for (auto& c : x->children) {
+            const N* y = c.load();
+            n += y->weight > 1 || (y->weight == 0 && x->weight == 0);
+            stack.push_back(y);
+        }
+    }
+    return n;
+}
+
+///////////////////////// Expiry_index IMPLEMENTATION /////////////////////////
+template <typename K, typename Clock>
+void Expiry_index<K,Clock>::set(const K& key, time_point at) {
+    auto [it, added] = deadlines.try_emplace(key, Deadline{at, at});
+    if (added) {
+        queue.insert(Entry{at, key});
+        return;
+    }
+    Deadline& d = it->second;
+    d.at = at;
+    if (at < d.queued) {
+        // the entry would come too late: move it
+        queue.Delete(Entry{d.queued, key});
+        queue.insert(Entry{at, key});
+        d.queued = at;
+    }
+}
+
+template <typename K, typename Clock>
+bool Expiry_index<K,Clock>::erase(const K& key) {
+    auto it = deadlines.find(key);
+    if (it == deadlines.end()) {
+        return false;
+    }
+    queue.Delete(Entry{it->second.queued, key});
+    deadlines.erase(it);
+    return true;
+}
+
+template <typename K, typename Clock>
+typename Expiry_index<K,Clock>::Sweep Expiry_index<K,Clock>::expire_before(time_point t,
+                                                                          const std::function<void(const K&)>& on_expire) {
+    Sweep sweep;
+    auto t1 = std::chrono::steady_clock::now();
+    {
+        auto due = queue.split_while([t](const Entry& e) { return e.at < t; });
+        for (const Entry& e : due) {
+            auto it = deadlines.find(e.key);
+            Deadline& d = it->second;
+            if (d.at < t) {
+                if (on_expire) {
+                    on_expire(e.key);
+                }
+                deadlines.erase(it);
+                ++sweep.expired;
+            } else {
+                queue.insert(Entry{d.at, e.key});
+                d.queued = d.at;
+                ++sweep.requeued;
+            }
+        }
+    } // the due entries are freed here
+    auto t2 = std::chrono::steady_clock::now();
+    sweep.ms = std::chrono::duration<double, std::milli>(t2 - t1).count();
+    return sweep;
+}
+
+///////////////////////// Hashed_RBTree IMPLEMENTATION /////////////////////////
+template <typename T, typename CMP, typename B>
+Hashed_RBTree<T,CMP,B>::Hashed_RBTree(std::size_t expected) {
+    std::size_t size = 16;
+    shift = 60;
+    while (size / 4 * 3 < expected) {
+        size <<= 1;
+        --shift;
+    }
+    slots.assign(size, nullptr);
+}
+
+template <typename T, typename CMP, typename B>
+std::size_t Hashed_RBTree<T,CMP,B>::slot_of(const T& key) const {
+    const std::size_t mask = slots.size() - 1;
+    for (std::size_t i = home(key);; i = (i + 1) & mask) {
+        const Node<T>* x = slots[i];
+        if (!x || (!ordered.cmp(key, x->key) && !ordered.cmp(x->key, key))) {
+            return i;
+        }
+    }
+}
+
+// Pull back every later entry of the probe run that may live in slot i:
+template <typename T, typename CMP, typename B>
+void Hashed_RBTree<T,CMP,B>::erase_slot(std::size_t i) {
+    const std::size_t mask = slots.size() - 1;
+    for (std::size_t j = (i + 1) & mask; slots[j]; j = (j + 1) & mask) {
+        const std::size_t h = home(slots[j]->key);
+        if (((j - h) & mask) >= ((j - i) & mask)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i] = nullptr;
+}
+
+template <typename T, typename CMP, typename B>
+void Hashed_RBTree<T,CMP,B>::grow() {
+    std::vector<Node<T>*> old(slots.size() * 2, nullptr);
+    old.swap(slots);
+    --shift;
+    const std::size_t mask = slots.size() - 1;
+    for (Node<T>* x : old) {
+        if (x) {
+            std::size_t i = home(x->key);
+            while (slots[i]) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = x;
+        }
+    }
+}
+
+template <typename T, typename CMP, typename B>
+bool Hashed_RBTree<T,CMP,B>::insert(const T& key) {
+    if ((count + 1) * 4 > slots.size() * 3) {
+        grow();
+    }
+    const std::size_t i = slot_of(key);
+    if (slots[i]) {
+        return false;
+    }
+    // The tree has the last word, should a key the index missed be there:
+    Node<T>* x = ordered.insert(ordered.new_node(key));
+    if (!x) {
+        return false;
+    }
+    slots[i] = x;
+    ++count;
+    return true;
+}
+
+template <typename T, typename CMP, typename B>
+bool Hashed_RBTree<T,CMP,B>::Delete(const T& key) {
+    const std::size_t i = slot_of(key);
+    Node<T>* z = slots[i];
+    if (!z) {
+        return false;
+    }
+    erase_slot(i);
+    --count;
+    return ordered.Delete(z);
+}
+
+///////////////////////// Latency_log IMPLEMENTATION /////////////////////////
+inline double Tick_clock::ns_per_tick() {
+    static const double ratio = [] {
+        using clock = std::chrono::steady_clock;
+        auto t0 = clock::now();
+        auto c0 = now();
+        while (clock::now() - t0 < std::chrono::milliseconds{10}) {
+        }
+        auto c1 = now();
+        auto t1 = clock::now();
+        return std::chrono::duration<double, std::nano>(t1 - t0).count() / static_cast<double>(c1 - c0);
+    }();
+    return ratio;
+}
+
+inline void Latency_log::report(std::ostream& os) const {
+    static const char* const names[] = {
+        "insert", "  alloc", "  link", "  fixup",
+        "Delete", "  search", "  unlink", "  fixup", "  free",
+        "contains"
+    };
+    os << "phase          count    p50 ns    p90 ns    p99 ns  p99.9 ns    max ns\n";
+    for (std::size_t i = 0; i < phases.size(); ++i) {
+        const Latency_histogram& h = phases[i];
+        if (!h.count()) {
+            continue;
+        }
+        os << std::left << std::setw(10) << names[i] << std::right << std::setw(10) << h.count();
+        for (double p : {50.0, 90.0, 99.0, 99.9}) {
+            os << std::setw(10) << h.percentile(p);
+        }
+        os << std::setw(10) << h.max() << '\n';
+    }
+}
+
+///////////////////////// Radix_RBTree IMPLEMENTATION /////////////////////////
+template <std::integral T, unsigned Bits, unsigned KeyBits, typename B>
+std::size_t Radix_RBTree<T,Bits,KeyBits,B>::next_used(std::size_t b) const{
+    for (std::size_t w = b >> 6; w < used.size(); ++w) {
+        std::uint64_t bits = used[w];
+        if (w == b >> 6) {
+            bits &= ~std::uint64_t{0} << (b & 63);
+        }
+        if (bits) {
+            return w * 64 + static_cast<std::size_t>(std::countr_zero(bits));
+        }
+    }
+    return bucket_count;
+}
+
+template <std::integral T, unsigned Bits, unsigned KeyBits, typename B>
+bool Radix_RBTree<T,Bits,KeyBits,B>::insert(T key){
+    const std::size_t b = bucket_of(key);
+    if (!buckets[b].try_insert(key)) {
+        return false;
+    }
+    ++count;
+    mark(b);
+    return true;
+}
+
+template <std::integral T, unsigned Bits, unsigned KeyBits, typename B>
+bool Radix_RBTree<T,Bits,KeyBits,B>::Delete(T key){
+    const std::size_t b = bucket_of(key);
+    if (!buckets[b].Delete(key)) {
+        return false;
+    }
+    --count;
+    mark(b);
+    return true;
+}
+
+template <std::integral T, unsigned Bits, unsigned KeyBits, typename B>
+typename Radix_RBTree<T,Bits,KeyBits,B>::const_iterator Radix_RBTree<T,Bits,KeyBits,B>::lower_bound(T key) const{
+    std::size_t b = bucket_of(key);
+    auto it = buckets[b].lower_bound(key);
+    if (it == buckets[b].end()) {
+        // every key of the later buckets is larger
+        b = next_used(b + 1);
+        return b < bucket_count ? const_iterator{this, b, buckets[b].begin()} : end();
+    }
+    return const_iterator{this, b, it};
+}
+
+///////////////////////// Buffered_RBTree IMPLEMENTATION /////////////////////////
+template <typename T, typename CMP, typename B>
+Buffered_RBTree<T,CMP,B>::Buffered_RBTree(std::size_t capacity)
+    : capacity{std::max<std::size_t>(capacity, 1)},
+      run_size{std::max<std::size_t>(static_cast<std::size_t>(std::sqrt(static_cast<double>(capacity))), 1)} {
+    recent.reserve(run_size);
+}
+
+template <typename T, typename CMP, typename B>
+void Buffered_RBTree<T,CMP,B>::stage(const T& key, bool insert){
+    auto p = std::lower_bound(recent.begin(), recent.end(), key,
+                              [this](const Pending& e, const T& k) { return cmp(e.key, k); });
+    if (p != recent.end() && !cmp(key, p->key)) {
+        p->insert = insert; // the later write wins
+        return;
+    }
+    recent.insert(p, Pending{key, insert});
+    if (recent.size() >= run_size) {
+        merge_recent();
+        if (staged.size() >= capacity) {
+            flush();
+        }
+    }
+}
+
+template <typename T, typename CMP, typename B>
+void Buffered_RBTree<T,CMP,B>::merge_recent(){
+    spare.clear();
+    spare.reserve(staged.size() + recent.size());
+    auto s = staged.begin();
+    for (const Pending& r : recent) {
+        for (; s != staged.end() && cmp(s->key, r.key); ++s) {
+            spare.push_back(*s);
+        }
+        if (s != staged.end() && !cmp(r.key, s->key)) {
+            ++s; // overwritten by r
+        }
+        spare.push_back(r);
+    }
+    spare.insert(spare.end(), s, staged.end());
+    staged.swap(spare);
+    recent.clear();
+}
+
+template <typename T, typename CMP, typename B>
+void Buffered_RBTree<T,CMP,B>::flush(){
+    merge_recent();
+    _iterator finger{nullptr};
+    for (const Pending& p : staged) {
+        if (p.insert) {
+            finger = ordered.insert(finger, p.key);
+        } else if (auto it = ordered.find(finger, p.key); it != ordered.end()) {
+            // the next key is as good a finger as the deleted one
+            finger = ordered.erase(it);
+        }
+    }
+    staged.clear();
+}
+
+#endif
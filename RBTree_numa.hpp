@@ -0,0 +1,391 @@
+// NUMA placement for RBTree: the node layout of the machine, memory
+// policies, and Replicated_RBTree, one replica per node. Linux only.
+
+#ifndef RBTREE_NUMA_HPP
+#define RBTREE_NUMA_HPP
+
+#include "RBTree.hpp"
+#include <filesystem>
+#include <fstream>
+#include <shared_mutex>
+#include <system_error>
+#include <sched.h>  // for sched_getcpu, sched_setaffinity
+#include <sys/mman.h>  // for mmap
+#include <sys/syscall.h>
+#include <linux/mempolicy.h> // for MPOL_PREFERRED
+
+
+// NUMA layout: the CPUs of each node and the memory node its data should
+// come from. simulated(n) deals the online CPUs out to n nodes whose memory
+// nodes wrap around the real ones, so a multi-node setup runs anywhere.
+struct Numa_topology {
+    std::vector<std::vector<int>> cpus; // per node
+    std::vector<int> memory_node;       // per node
+    std::vector<unsigned> node_of_cpu;
+
+    // From /sys/devices/system/node, or a single node if it is missing:
+    static Numa_topology detect();
+    static Numa_topology simulated(unsigned nodes);
+    std::size_t nodes() const { return cpus.size(); }
+    // Node of the CPU running the calling thread:
+    unsigned current_node() const;
+    // Restrict the calling thread to the CPUs of node:
+    void pin_to(unsigned node) const;
+};
+
+// Ask for the pages of [p, p + n) to come from memory_node, whichever thread
+// faults them in (a no-op where the kernel refuses):
+inline void bind_to_memory_node(void* p, std::size_t n, int memory_node) {
+    if (memory_node >= 0 && memory_node < 64) {
+        unsigned long mask = 1ul << memory_node;
+        ::syscall(SYS_mbind, p, n, MPOL_PREFERRED, &mask, sizeof mask * 8, 0);
+    }
+}
+
+// Source of nodes bound to one NUMA memory node. Nodes are carved in turn
+// from Node_blocks mapped for the arena and bound to the node, so where they
+// live depends neither on which thread first touches a page nor on what
+// else shares the pages of malloc. As after RBTree::compact, a block is
+// unmapped along with its last node, even if the arena is gone by then.
+// While a Scope is alive, the nodes an RBTree<T> allocates on the calling
+// thread come from the arena. One thread at a time may use an arena.
+template <typename T>
+class Node_arena : public Node_source<T> {
+    using Block = Node_block<T>;
+    int memory_node;
+    Block* block = nullptr;  // being carved, holding a reference of ours
+    Node<T>* next = nullptr; // its next free slot
+    std::size_t left = 0;    // free slots from next on
+    std::size_t mapped = 0;
+
+    static void unmap(void* p) { ::munmap(p, Block::bytes); }
+    // A block in pages of its own, bound to memory_node, with one
+    // reference, the arena's:
+    Node<T>* map() const {
+        // Map twice the size and trim it down to an aligned block:
+        void* p = ::mmap(nullptr, 2 * Block::bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::bad_alloc{};
+        }
+        const auto first = reinterpret_cast<std::uintptr_t>(p);
+        const auto start = (first + Block::bytes - 1) & ~(Block::bytes - 1);
+        if (start > first) {
+            ::munmap(p, start - first);
+        }
+        if (start + Block::bytes < first + 2 * Block::bytes) {
+            ::munmap(reinterpret_cast<void*>(start + Block::bytes), first + Block::bytes - start);
+        }
+        bind_to_memory_node(reinterpret_cast<void*>(start), Block::bytes, memory_node);
+        return Block::adopt(reinterpret_cast<void*>(start), 1, unmap);
+    }
+
+    public:
+    using Scope = typename Node_source<T>::Scope;
+
+    explicit Node_arena(int memory_node) : memory_node{memory_node} {}
+    ~Node_arena() {
+        if (block) {
+            Block::unref(block);
+        }
+    }
+    Node_arena(const Node_arena&) = delete;
+    Node_arena& operator=(const Node_arena&) = delete;
+
+    void* allocate() override {
+        if (!left) {
+            next = map();
+            if (block) {
+                Block::unref(block);
+            }
+            block = Block::of(next);
+            left = Block::capacity;
+            ++mapped;
+        }
+        block->live.fetch_add(1, std::memory_order_relaxed);
+        --left;
+        return next++;
+    }
+    // Blocks mapped so far:
+    std::size_t blocks() const { return mapped; }
+};
+
+// While alive, pages first touched by the calling thread come from
+// memory_node if it has room (a no-op where the kernel refuses); the
+// thread's previous policy is restored afterwards. This only places fresh
+// pages: memory that malloc hands out from pages it already has stays
+// where it is, which is why RBTree nodes go through a Node_arena instead.
+class Memory_node_scope {
+    static constexpr unsigned long max_nodes = 1024;
+    bool set = false;
+    int saved_mode = MPOL_DEFAULT;
+    unsigned long saved_mask[max_nodes / (8 * sizeof(unsigned long))] = {};
+
+    public:
+    explicit Memory_node_scope(int memory_node) {
+        if (memory_node >= 0 && memory_node < 64
+            && ::syscall(SYS_get_mempolicy, &saved_mode, saved_mask, max_nodes, nullptr, 0) == 0) {
+            unsigned long mask = 1ul << memory_node;
+            set = ::syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof mask * 8) == 0;
+        }
+    }
+    ~Memory_node_scope() {
+        if (set) {
+            ::syscall(SYS_set_mempolicy, saved_mode, saved_mode == MPOL_DEFAULT ? nullptr : saved_mask,
+                      saved_mode == MPOL_DEFAULT ? 0 : max_nodes);
+        }
+    }
+    Memory_node_scope(const Memory_node_scope&) = delete;
+    Memory_node_scope& operator=(const Memory_node_scope&) = delete;
+};
+
+// One RBTree replica per NUMA node behind a shared operation log (node
+// replication, Calciu et al.). A write appends to the log and applies it to
+// the writer's replica; the other replicas replay the log lazily, when a
+// read on their node finds them behind. Reads are served by the replica of
+// the node they run on, whose nodes come from a Node_arena bound to that
+// node's memory, so a search never leaves the socket. A read sees every write that completed before it.
+template <typename T, typename CMP=std::less<T>, typename Balance=RB_balance>
+class Replicated_RBTree {
+    struct Log_entry {
+        T key;
+        bool insert;
+    };
+    struct alignas(64) Replica {
+        Node_arena<T> arena; // where the nodes of tree come from
+        RBTree<T, CMP, Balance> tree;
+        std::shared_mutex mutex;
+        std::atomic<std::size_t> applied{0}; // log entries replayed
+
+        explicit Replica(int memory_node) : arena{memory_node} {}
+    };
+    Numa_topology topology;
+    mutable std::vector<std::unique_ptr<Replica>> replicas;
+    mutable std::mutex log_mutex;
+    std::deque<Log_entry> log;
+    std::size_t log_base = 0;             // position of log.front()
+    std::atomic<std::size_t> log_tail{0}; // position past the last entry
+    std::size_t log_limit;
+
+    // PRIVATE METHODS
+    static bool apply(RBTree<T, CMP, Balance>& tree, const Log_entry& e) {
+        return e.insert ? tree.try_insert(e.key) : tree.Delete(e.key);
+    }
+    // Replay the log up to position `upto` on the replica of node, whose
+    // write lock the caller holds:
+    void catch_up(unsigned node, std::size_t upto) const;
+    // Bring the replica of node up to date and lock it for reading:
+    std::shared_lock<std::shared_mutex> read_lock(unsigned node) const;
+    bool write(const T& key, bool insert, unsigned node);
+    // Let every replica catch up, then drop the log entries all have seen:
+    void trim();
+
+    public:
+    // ctor: log_limit entries may wait for a lagging replica before writers
+    // replay the log on its behalf
+    explicit Replicated_RBTree(Numa_topology topology = Numa_topology::detect(), std::size_t log_limit = 1 << 16);
+
+    const Numa_topology& numa() const { return topology; }
+    std::size_t replica_count() const { return replicas.size(); }
+    std::size_t log_size() const {
+        std::lock_guard lock{log_mutex};
+        return log.size();
+    }
+
+    // PUBLIC METHODS, each on the replica of the calling thread's node or of `node`
+    bool insert(const T& key) { return insert(key, topology.current_node()); }
+    bool insert(const T& key, unsigned node) { return write(key, true, node); }
+    bool Delete(const T& key) { return Delete(key, topology.current_node()); }
+    bool Delete(const T& key, unsigned node) { return write(key, false, node); }
+    bool contains(const T& key) const { return contains(key, topology.current_node()); }
+    bool contains(const T& key, unsigned node) const {
+        auto lock = read_lock(node);
+        return replicas[node]->tree.contains(key);
+    }
+    std::size_t size(unsigned node = 0) const {
+        auto lock = read_lock(node);
+        return replicas[node]->tree.size();
+    }
+    // Call f(const RBTree&) on an up-to-date replica, e.g. to iterate over it:
+    template <typename F>
+    auto read(F f, unsigned node) const {
+        auto lock = read_lock(node);
+        return f(static_cast<const RBTree<T, CMP, Balance>&>(replicas[node]->tree));
+    }
+};
+
+
+///////////////////////// Replicated_RBTree IMPLEMENTATION /////////////////////////
+inline Numa_topology Numa_topology::detect() {
+    Numa_topology t;
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    for (int node = 0; fs::exists("/sys/devices/system/node/node" + std::to_string(node), ec); ++node) {
+        std::ifstream in{"/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"};
+        std::vector<int> cpus;
+        // "0-3,8-11"
+        std::string range;
+        while (std::getline(in, range, ',')) {
+            int lo = 0, hi = -1;
+            const char* last = range.data() + range.size();
+            auto [p, e] = std::from_chars(range.data(), last, lo);
+            hi = lo;
+            if (e == std::errc{} && p < last && *p == '-') {
+                std::from_chars(p + 1, last, hi);
+            }
+            for (int c = lo; e == std::errc{} && c <= hi; ++c) {
+                cpus.push_back(c);
+            }
+        }
+        if (!cpus.empty()) { // memory-only nodes serve no reader
+            t.cpus.push_back(std::move(cpus));
+            t.memory_node.push_back(node);
+        }
+    }
+    if (t.cpus.empty()) {
+        return simulated(1);
+    }
+    for (unsigned node = 0; node < t.nodes(); ++node) {
+        for (int c : t.cpus[node]) {
+            if (t.node_of_cpu.size() <= static_cast<std::size_t>(c)) {
+                t.node_of_cpu.resize(static_cast<std::size_t>(c) + 1, 0);
+            }
+            t.node_of_cpu[static_cast<std::size_t>(c)] = node;
+        }
+    }
+    return t;
+}
+
+inline Numa_topology Numa_topology::simulated(unsigned nodes) {
+    Numa_topology real;
+    real.memory_node = {0};
+    if (nodes > 1) {
+        real = detect();
+    }
+    Numa_topology t;
+    nodes = std::max(nodes, 1u);
+    t.cpus.resize(nodes);
+    for (unsigned node = 0; node < nodes; ++node) {
+        t.memory_node.push_back(real.memory_node[node % real.memory_node.size()]);
+    }
+    cpu_set_t online;
+    CPU_ZERO(&online);
+    ::sched_getaffinity(0, sizeof online, &online);
+    unsigned next = 0;
+    for (int c = 0; c < CPU_SETSIZE; ++c) {
+        if (CPU_ISSET(c, &online)) {
+            t.cpus[next++ % nodes].push_back(c);
+            t.node_of_cpu.resize(static_cast<std::size_t>(c) + 1, 0);
+            t.node_of_cpu[static_cast<std::size_t>(c)] = (next - 1) % nodes;
+        }
+    }
+    // With fewer CPUs than nodes, the last nodes share the first CPUs:
+    for (unsigned node = next; node < nodes; ++node) {
+        t.cpus[node] = t.cpus[node % std::max(next, 1u)];
+    }
+    return t;
+}
+
+inline unsigned Numa_topology::current_node() const {
+    const int c = ::sched_getcpu();
+    return c >= 0 && static_cast<std::size_t>(c) < node_of_cpu.size() ? node_of_cpu[static_cast<std::size_t>(c)] : 0;
+}
+
+inline void Numa_topology::pin_to(unsigned node) const {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus[node]) {
+        CPU_SET(c, &set);
+    }
+    if (::sched_setaffinity(0, sizeof set, &set) != 0) {
+        throw std::system_error{errno, std::generic_category(), "sched_setaffinity"};
+    }
+}
+
+template <typename T, typename CMP, typename B>
+Replicated_RBTree<T,CMP,B>::Replicated_RBTree(Numa_topology t, std::size_t log_limit)
+    : topology{std::move(t)}, log_limit{log_limit} {
+    for (std::size_t node = 0; node < topology.nodes(); ++node) {
+        replicas.push_back(std::make_unique<Replica>(topology.memory_node[node]));
+    }
+}
+
+template <typename T, typename CMP, typename B>
+void Replicated_RBTree<T,CMP,B>::catch_up(unsigned node, std::size_t upto) const{
+    Replica& r = *replicas[node];
+    const std::size_t from = r.applied.load(std::memory_order_relaxed);
+    if (from >= upto) {
+        return;
+    }
+    // Copy the entries out, so that writers can append meanwhile:
+    std::vector<Log_entry> batch;
+    {
+        std::lock_guard lock{log_mutex};
+        batch.assign(log.begin() + static_cast<std::ptrdiff_t>(from - log_base),
+                     log.begin() + static_cast<std::ptrdiff_t>(upto - log_base));
+    }
+    Memory_node_scope local{topology.memory_node[node]};
+    typename Node_arena<T>::Scope nodes{r.arena};
+    for (const Log_entry& e : batch) {
+        apply(r.tree, e);
+    }
+    r.applied.store(upto, std::memory_order_release);
+}
+
+template <typename T, typename CMP, typename B>
+std::shared_lock<std::shared_mutex> Replicated_RBTree<T,CMP,B>::read_lock(unsigned node) const{
+    Replica& r = *replicas[node];
+    const std::size_t tail = log_tail.load(std::memory_order_acquire);
+    if (r.applied.load(std::memory_order_acquire) < tail) {
+        std::unique_lock lock{r.mutex};
+        catch_up(node, tail);
+    }
+    return std::shared_lock{r.mutex};
+}
+
+template <typename T, typename CMP, typename B>
+bool Replicated_RBTree<T,CMP,B>::write(const T& key, bool insert, unsigned node){
+    Replica& r = *replicas[node];
+    bool done;
+    bool full;
+    {
+        // Holding the replica while appending: nobody else can replay our
+        // entry on it, so its outcome is ours.
+        std::unique_lock lock{r.mutex};
+        std::size_t pos;
+        {
+            std::lock_guard log_lock{log_mutex};
+            log.push_back(Log_entry{key, insert});
+            pos = log_base + log.size();
+            log_tail.store(pos, std::memory_order_release);
+            full = log.size() > log_limit;
+        }
+        catch_up(node, pos - 1);
+        Memory_node_scope local{topology.memory_node[node]};
+        typename Node_arena<T>::Scope nodes{r.arena};
+        done = apply(r.tree, Log_entry{key, insert});
+        r.applied.store(pos, std::memory_order_release);
+    }
+    if (full) {
+        trim();
+    }
+    return done;
+}
+
+template <typename T, typename CMP, typename B>
+void Replicated_RBTree<T,CMP,B>::trim(){
+    const std::size_t tail = log_tail.load(std::memory_order_acquire);
+    std::size_t oldest = tail;
+    for (unsigned node = 0; node < replicas.size(); ++node) {
+        // The replay allocates under the replica's memory node, even from here:
+        std::unique_lock lock{replicas[node]->mutex};
+        catch_up(node, tail);
+        oldest = std::min(oldest, replicas[node]->applied.load(std::memory_order_relaxed));
+    }
+    std::lock_guard lock{log_mutex};
+    while (log_base < oldest && !log.empty()) {
+        log.pop_front();
+        ++log_base;
+    }
+}
+
+#endif
@@ -0,0 +1,845 @@
+// File-backed members of the RBTree family: PagedRBTree, whose nodes live
+// in pages of a file behind a buffer pool, and Durable_RBTree, an RBTree
+// behind a write-ahead log. They need POSIX file I/O, which RBTree.hpp
+// itself does not.
+
+#ifndef RBTREE_STORAGE_HPP
+#define RBTREE_STORAGE_HPP
+
+#include "RBTree.hpp"
+#include <map>
+#include <filesystem>
+#include <system_error>
+#include <fcntl.h>  // for open
+#include <unistd.h> // for pread, pwrite, close
+
+
+// Buffer pool over a file of fixed-size pages. A page stays in memory while
+// it is pinned; unpinned pages are evicted with the CLOCK algorithm and
+// written back if dirty. Pages past the end of the file read as zeros.
+class Buffer_pool {
+    struct Frame {
+        std::uint32_t page = 0;
+        int pins = 0;
+        bool used = false;
+        bool referenced = false;
+        bool dirty = false;
+    };
+    int fd;
+    std::vector<char> memory;
+    std::vector<Frame> frames;
+    std::unordered_map<std::uint32_t, std::size_t> table; // page -> frame
+    std::size_t hand = 0;
+
+    char* frame_bytes(std::size_t i) { return memory.data() + i * page_size; }
+    void write_back(std::size_t i);
+    std::size_t victim();
+
+    public:
+    static constexpr std::size_t page_size = 4096;
+    // I/O and hit-rate counters:
+    std::size_t hits = 0;
+    std::size_t reads = 0;
+    std::size_t writes = 0;
+
+    // Open (and truncate) the backing file with room for `frame_count` pages in memory:
+    Buffer_pool(const std::string& path, std::size_t frame_count);
+    ~Buffer_pool();
+    Buffer_pool(const Buffer_pool&) = delete;
+    Buffer_pool& operator=(const Buffer_pool&) = delete;
+
+    // Pin a page and return its bytes; every pin needs an unpin:
+    char* pin(std::uint32_t page);
+    void unpin(std::uint32_t page, bool dirty) noexcept;
+    // Write every dirty page back to the file:
+    void flush();
+    std::size_t capacity() const { return frames.size(); }
+};
+
+// Keeps a page pinned for its lifetime:
+class Page_guard {
+    Buffer_pool* pool;
+    std::uint32_t page;
+    char* bytes;
+    bool dirty = false;
+
+    public:
+    Page_guard(Buffer_pool& p, std::uint32_t pg) : pool{&p}, page{pg}, bytes{p.pin(pg)} {}
+    Page_guard(Page_guard&& g) noexcept : pool{g.pool}, page{g.page}, bytes{g.bytes}, dirty{g.dirty} {
+        g.pool = nullptr;
+    }
+    Page_guard(const Page_guard&) = delete;
+    Page_guard& operator=(const Page_guard&) = delete;
+    ~Page_guard() noexcept {
+        if (pool) {
+            pool->unpin(page, dirty);
+        }
+    }
+    const char* data() const { return bytes; }
+    char* data_for_write() {
+        dirty = true;
+        return bytes;
+    }
+};
+
+// Record of a node of the paged tree. Links are node ids instead of
+// pointers; id 0 is the nil sentinel (black, never stored).
+template <typename T>
+struct PNode {
+    T key;
+    std::uint32_t children[2]; // indexed by side: [0] left, [1] right
+    std::uint32_t parent;
+    Color color;
+};
+
+// Class to represent a Red-Black Tree whose nodes live in the pages of a
+// local file, reached through a buffer pool of a fixed number of frames.
+// Node id i is slot i % slots of page i / slots. The file is a backing
+// store for one tree object, not a persistent format.
+template <typename T, typename CMP=std::less<T>>
+class PagedRBTree {
+    static_assert(std::is_trivially_copyable<T>::value, "keys are copied to pages byte by byte");
+    using Id = std::uint32_t;
+    static constexpr std::size_t slots = Buffer_pool::page_size / sizeof(PNode<T>);
+
+    // A pinned node, read through -> and written through mut():
+    class Node_ref {
+        Page_guard guard;
+        std::size_t offset;
+
+        public:
+        Node_ref(Buffer_pool& pool, Id x)
+            : guard{pool, static_cast<std::uint32_t>(x / slots)}, offset{x % slots * sizeof(PNode<T>)} {}
+        const PNode<T>* operator->() const { return reinterpret_cast<const PNode<T>*>(guard.data() + offset); }
+        PNode<T>* mut() { return reinterpret_cast<PNode<T>*>(guard.data_for_write() + offset); }
+    };
+
+    mutable Buffer_pool pool;
+    Id root = 0;
+    Id next_id = 1;
+    std::vector<Id> free_ids;
+    std::size_t count = 0;
+    CMP cmp;
+
+    // PRIVATE METHODS
+    Node_ref ref(Id x) const { return Node_ref{pool, x}; }
+    Color color(Id x) const { return x ? ref(x)->color : Color::black; }
+    bool is_red(Id x) const { return color(x) == Color::red; }
+    Id child(Id x, bool dir) const { return ref(x)->children[dir]; }
+    Id parent(Id x) const { return ref(x)->parent; }
+    bool is_right_child(Id x) const { return child(parent(x), true) == x; }
+    void set_color(Id x, Color c) { ref(x).mut()->color = c; }
+    void set_parent(Id x, Id p) {
+        if (x) {
+            ref(x).mut()->parent = p;
+        }
+    }
+    // Make c the child of x on side dir (x == 0 stands for the root link):
+    void set_child(Id x, bool dir, Id c) {
+        if (x) {
+            ref(x).mut()->children[dir] = c;
+        } else {
+            root = c;
+        }
+    }
+    Id search_subtree(const T& key) const;
+    Id minimum_in_subtree(Id x) const;
+    // Rotate the subtree at x so that x goes down on side dir:
+    void rotate(Id x, bool dir);
+    void transplant(Id x, Id y);
+    void insert_fixup(Id z);
+    void delete_fixup(Id x, Id xp);
+
+    public:
+    // ctor: the tree keeps at most `frames` pages of the file in memory
+    PagedRBTree(const std::string& path, std::size_t frames) : pool{path, frames}, cmp{} {
+        if (frames < 4) {
+            throw std::invalid_argument{"PagedRBTree: a rotation pins up to 4 pages"};
+        }
+    }
+
+    std::size_t size() const { return count; }
+    const Buffer_pool& buffer_pool() const { return pool; }
+    // Pages in use by the nodes so far:
+    std::size_t pages() const { return (next_id - 1) / slots + 1; }
+
+    // PUBLIC METHODS
+    // To insert a new value in the tree (duplicates are ignored):
+    bool insert(const T&);
+    // To test whether the tree contains a value:
+    bool contains(const T& key) const { return search_subtree(key) != 0; }
+    // To delete a value from the tree:
+    bool Delete(const T&);
+};
+
+// CRC-32 (IEEE) of a byte range, used to detect torn or corrupt records:
+inline std::uint32_t crc32(const char* bytes, std::size_t n, std::uint32_t crc = 0);
+
+// Durability layer around RBTree: every insert and Delete that changes the
+// tree appends a record [op][key][crc] to a write-ahead log and returns once
+// the record is on disk. With group commit, concurrent callers share one
+// fdatasync: the first waiting caller writes the records of everybody who
+// queued behind it. A change reaches the tree only once its record is
+// durable, so readers never see a change that a crash could undo. If a write
+// or fdatasync fails, every record not yet durable is dropped, the log is cut
+// back to its durable length, and each of their callers gets the error.
+// checkpoint() writes a snapshot of the keys (atomically, through a rename)
+// and truncates the log, so recovery reads the snapshot plus the log tail.
+// Keys must be trivially copyable.
+template <typename T, typename CMP=std::less<T>, typename Balance=RB_balance>
+class Durable_RBTree {
+    static_assert(std::is_trivially_copyable<T>::value, "keys are logged byte by byte");
+    enum class Op : char {insert = 1, remove = 2};
+    static constexpr std::size_t record_size = 1 + sizeof(T) + sizeof(std::uint32_t);
+
+    RBTree<T, CMP, Balance> tree;
+    std::string log_path;
+    std::string snapshot_path;
+    int log_fd = -1;
+    bool group_commit;
+    std::size_t checkpoint_every;
+
+    // Records lsn in (from, upto] were dropped after a failed write or sync:
+    struct Failure {
+        std::uint64_t from, upto;
+        std::exception_ptr error;
+    };
+    // Latest change logged but not yet durable for a key, which decides
+    // what the next insert or Delete of that key does:
+    struct Unapplied {
+        Op op;
+        std::uint64_t lsn;
+    };
+
+    mutable std::mutex m;
+    std::condition_variable flushed;
+    std::vector<char> pending;     // records not yet handed to a flush
+    std::map<T, Unapplied, CMP> unapplied;
+    std::uint64_t appended = 0;    // records logged so far
+    std::uint64_t durable = 0;     // records known to be on disk (and in the tree)
+    std::uint64_t checkpointed = 0;
+    std::size_t log_bytes = 0;     // durable length of the log
+    std::vector<Failure> failures;
+    bool broken = false;           // the log could not be cut back after a failure
+    bool flushing = false;
+    std::size_t syncs = 0;
+
+    // PRIVATE METHODS
+    void recover();
+    // The key is in the tree once every change logged so far is applied:
+    bool will_contain(const T& key) const {
+        auto it = unapplied.find(key);
+        return it != unapplied.end() ? it->second.op == Op::insert : tree.contains(key);
+    }
+    // Log a change, wait until it is durable and apply it to the tree:
+    void commit(std::unique_lock<std::mutex>&, Op, const T&);
+    // Apply the durable records [bytes, bytes + n), the last of which is upto:
+    void apply(const char* bytes, std::size_t n, std::uint64_t upto);
+    // Drop every record not yet durable after a failed write or sync:
+    void fail(std::exception_ptr);
+    void checkpoint(std::unique_lock<std::mutex>&);
+
+    public:
+    // ctor: recover the tree from dir (created if missing) and reopen its log
+    explicit Durable_RBTree(const std::string& dir, bool group_commit = true, std::size_t checkpoint_every = 0);
+    ~Durable_RBTree() noexcept { ::close(log_fd); }
+    Durable_RBTree(const Durable_RBTree&) = delete;
+    Durable_RBTree& operator=(const Durable_RBTree&) = delete;
+
+    // PUBLIC METHODS (safe to call from several threads)
+    // To insert a new value in the tree (duplicates are ignored):
+    bool insert(const T&);
+    // To delete a value from the tree:
+    bool Delete(const T&);
+    bool contains(const T& key) const {
+        std::lock_guard<std::mutex> lk{m};
+        return tree.contains(key);
+    }
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lk{m};
+        return tree.size();
+    }
+    // Number of fdatasync calls on the log so far:
+    std::size_t sync_count() const {
+        std::lock_guard<std::mutex> lk{m};
+        return syncs;
+    }
+    // Write a snapshot and truncate the log:
+    void checkpoint() {
+        std::unique_lock<std::mutex> lk{m};
+        checkpoint(lk);
+    }
+};
+
+
+///////////////////////// PagedRBTree IMPLEMENTATION /////////////////////////
+inline Buffer_pool::Buffer_pool(const std::string& path, std::size_t frame_count)
+    : fd{::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)}, memory(frame_count * page_size), frames(frame_count) {
+    if (fd < 0) {
+        throw std::system_error{errno, std::generic_category(), "open " + path};
+    }
+}
+
+inline Buffer_pool::~Buffer_pool(){
+    try {
+        flush();
+    } catch (const std::system_error& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    ::close(fd);
+}
+
+inline void Buffer_pool::write_back(std::size_t i){
+    Frame& f = frames[i];
+    auto n = ::pwrite(fd, frame_bytes(i), page_size, static_cast<off_t>(f.page) * page_size);
+    if (n != static_cast<ssize_t>(page_size)) {
+        throw std::system_error{errno, std::generic_category(), "pwrite"};
+    }
+    ++writes;
+    f.dirty = false;
+}
+
+inline std::size_t Buffer_pool::victim(){
+    // Two sweeps clear every reference bit, so a third finds nothing new:
+    for (std::size_t step = 0; step < 2 * frames.size() + 1; ++step) {
+        std::size_t i = hand;
+        hand = (hand + 1) % frames.size();
+        Frame& f = frames[i];
+        if (!f.used) {
+            return i;
+        }
+        if (f.pins) {
+            continue;
+        }
+        if (f.referenced) {
+            f.referenced = false;
+            continue;
+        }
+        return i;
+    }
+    throw std::runtime_error{"Buffer_pool: every frame is pinned"};
+}
+
+inline char* Buffer_pool::pin(std::uint32_t page){
+    auto it = table.find(page);
+    if (it != table.end()) {
+        ++hits;
+        Frame& f = frames[it->second];
+        ++f.pins;
+        f.referenced = true;
+        return frame_bytes(it->second);
+    }
+    std::size_t i = victim();
+    Frame& f = frames[i];
+    if (f.used) {
+        if (f.dirty) {
+            write_back(i);
+        }
+        table.erase(f.page);
+        f.used = false;
+    }
+    char* bytes = frame_bytes(i);
+    auto n = ::pread(fd, bytes, page_size, static_cast<off_t>(page) * page_size);
+    if (n < 0) {
+        throw std::system_error{errno, std::generic_category(), "pread"};
+    }
+    std::memset(bytes + n, 0, page_size - n);
+    ++reads;
+    f.page = page;
+    f.pins = 1;
+    f.used = true;
+    f.referenced = true;
+    f.dirty = false;
+    table.emplace(page, i);
+    return bytes;
+}
+
+inline void Buffer_pool::unpin(std::uint32_t page, bool dirty) noexcept{
+    auto it = table.find(page);
+    if (it != table.end()) {
+        Frame& f = frames[it->second];
+        --f.pins;
+        f.dirty = f.dirty || dirty;
+    }
+}
+
+inline void Buffer_pool::flush(){
+    for (std::size_t i = 0; i < frames.size(); ++i) {
+        if (frames[i].used && frames[i].dirty) {
+            write_back(i);
+        }
+    }
+}
+
+template <typename T, typename CMP>
+std::uint32_t PagedRBTree<T,CMP>::search_subtree(const T& key) const{
+    Id x = root;
+    while (x) {
+        auto n = ref(x);
+        bool dir = cmp(n->key, key);
+        if (!dir && !cmp(key, n->key)) {
+            break;
+        }
+        x = n->children[dir];
+    }
+    return x;
+}
+
+template <typename T, typename CMP>
+std::uint32_t PagedRBTree<T,CMP>::minimum_in_subtree(Id x) const{
+    for (Id l = child(x, false); l; l = child(x, false)) {
+        x = l;
+    }
+    return x;
+}
+
+template <typename T, typename CMP>
+void PagedRBTree<T,CMP>::rotate(Id x, bool dir){
+    // x and y stay pinned; b and the parent of x are pinned briefly:
+    auto nx = ref(x);
+    Id y = nx->children[!dir];
+    Id p = nx->parent;
+    auto ny = ref(y);
+    Id b = ny->children[dir];
+    nx.mut()->children[!dir] = b;
+    nx.mut()->parent = y;
+    ny.mut()->children[dir] = x;
+    ny.mut()->parent = p;
+    set_parent(b, x);
+    if (!p) {
+        root = y;
+    } else {
+        auto np = ref(p);
+        np.mut()->children[np->children[1] == x] = y;
+    }
+}
+
+template <typename T, typename CMP>
+void PagedRBTree<T,CMP>::transplant(Id x, Id y){
+    Id p = parent(x);
+    set_child(p, p && is_right_child(x), y);
+    set_parent(y, p);
+}
+
+template <typename T, typename CMP>
+bool PagedRBTree<T,CMP>::insert(const T& key){
+    Id y = 0;
+    bool dir = false;
+    for (Id x = root; x;) {
+        auto n = ref(x);
+        dir = cmp(n->key, key);
+        if (!dir && !cmp(key, n->key)) {
+            return false;
+        }
+        y = x;
+        x = n->children[dir];
+    }
+    Id z = next_id;
+    if (free_ids.empty()) {
+        ++next_id;
+    } else {
+        z = free_ids.back();
+        free_ids.pop_back();
+    }
+    *ref(z).mut() = PNode<T>{key, {0, 0}, y, Color::red};
+    set_child(y, dir, z);
+    ++count;
+    insert_fixup(z);
+    return true;
+}
+
+template <typename T, typename CMP>
+void PagedRBTree<T,CMP>::insert_fixup(Id z){
+    for (Id zp = parent(z); is_red(zp); zp = parent(z)) {
+        Id zpp = parent(zp);
+        bool s = is_right_child(zp);
+        Id y = child(zpp, !s);
+        if (is_red(y)) {
+            set_color(zp, Color::black);
+            set_color(y, Color::black);
+            set_color(zpp, Color::red);
+            z = zpp;
+        } else {
+            if (z == child(zp, !s)) {
+                rotate(zp, s);
+                z = zp;
+                zp = parent(z);
+            }
+            set_color(zp, Color::black);
+            set_color(zpp, Color::red);
+            rotate(zpp, !s);
+        }
+    }
+    set_color(root, Color::black);
+}
+
+template <typename T, typename CMP>
+bool PagedRBTree<T,CMP>::Delete(const T& key){
+    Id z = search_subtree(key);
+    if (!z) {
+        return false;
+    }
+    Id zl = child(z, false);
+    Id zr = child(z, true);
+    Color removed = color(z);
+    Id x = 0;
+    Id xp = 0;
+    if (!zl || !zr) {
+        x = zl ? zl : zr;
+        xp = parent(z);
+        transplant(z, x);
+    } else {
+        Id y = minimum_in_subtree(zr);
+        removed = color(y);
+        x = child(y, true);
+        xp = y;
+        if (parent(y) != z) {
+            xp = parent(y);
+            transplant(y, x);
+            set_child(y, true, zr);
+            set_parent(zr, y);
+        }
+        transplant(z, y);
+        set_child(y, false, zl);
+        set_parent(zl, y);
+        set_color(y, color(z));
+    }
+    free_ids.push_back(z);
+    --count;
+    if (removed == Color::black) {
+        delete_fixup(x, xp);
+    }
+    return true;
+}
+
+template <typename T, typename CMP>
+void PagedRBTree<T,CMP>::delete_fixup(Id x, Id xp){
+    while (x != root && !is_red(x)) {
+        bool s = x != child(xp, false);
+        Id w = child(xp, !s);
+        if (is_red(w)) {
+            set_color(w, Color::black);
+            set_color(xp, Color::red);
+            rotate(xp, s);
+            w = child(xp, !s);
+        }
+        if (w && !is_red(child(w, s)) && !is_red(child(w, !s))) {
+            set_color(w, Color::red);
+            x = xp;
+            xp = parent(xp);
+        } else if (w) {
+            if (!is_red(child(w, !s))) {
+                set_color(child(w, s), Color::black);
+                set_color(w, Color::red);
+                rotate(w, !s);
+                w = child(xp, !s);
+            }
+            set_color(w, color(xp));
+            set_color(xp, Color::black);
+            set_color(child(w, !s), Color::black);
+            rotate(xp, s);
+            x = root;
+        } else {
+            x = root;
+        }
+    }
+    if (x) {
+        set_color(x, Color::black);
+    }
+}
+
+
+///////////////////////// Durable_RBTree IMPLEMENTATION /////////////////////////
+inline std::uint32_t crc32(const char* bytes, std::size_t n, std::uint32_t crc){
+    static const auto table = [] {
+        std::array<std::uint32_t, 256> t{};
+        for (std::uint32_t i = 0; i < 256; ++i) {
+            std::uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (std::size_t i = 0; i < n; ++i) {
+        crc = table[(crc ^ static_cast<unsigned char>(bytes[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Write the whole buffer, retrying short writes:
+inline void write_all(int fd, const char* bytes, std::size_t n){
+    while (n) {
+        auto w = ::write(fd, bytes, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error{errno, std::generic_category(), "write"};
+        }
+        bytes += w;
+        n -= static_cast<std::size_t>(w);
+    }
+}
+
+inline void sync_file(int fd){
+#ifdef __APPLE__
+    int r = ::fsync(fd);
+#else
+    int r = ::fdatasync(fd);
+#endif
+    if (r < 0) {
+        throw std::system_error{errno, std::generic_category(), "fdatasync"};
+    }
+}
+
+inline std::vector<char> read_file(const std::string& path){
+    std::vector<char> bytes;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return bytes;
+    }
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof buf)) > 0) {
+        bytes.insert(bytes.end(), buf, buf + n);
+    }
+    ::close(fd);
+    if (n < 0) {
+        throw std::system_error{errno, std::generic_category(), "read " + path};
+    }
+    return bytes;
+}
+
+template <typename T, typename CMP, typename B>
+Durable_RBTree<T,CMP,B>::Durable_RBTree(const std::string& dir, bool group_commit, std::size_t checkpoint_every)
+    : log_path{dir + "/wal.log"}, snapshot_path{dir + "/snapshot"},
+      group_commit{group_commit}, checkpoint_every{checkpoint_every} {
+    std::filesystem::create_directories(dir);
+    recover();
+}
+
+template <typename T, typename CMP, typename B>
+void Durable_RBTree<T,CMP,B>::recover(){
+    // Snapshot: [count][keys...][crc of the keys], sorted
+    auto snap = read_file(snapshot_path);
+    if (!snap.empty()) {
+        std::uint64_t n = 0;
+        if (snap.size() >= sizeof n) {
+            std::memcpy(&n, snap.data(), sizeof n);
+        }
+        std::uint32_t crc = 0;
+        if (snap.size() != sizeof n + n * sizeof(T) + sizeof crc) {
+            throw std::runtime_error{"Durable_RBTree: truncated snapshot " + snapshot_path};
+        }
+        const char* keys = snap.data() + sizeof n;
+        std::memcpy(&crc, keys + n * sizeof(T), sizeof crc);
+        if (crc != crc32(keys, n * sizeof(T))) {
+            throw std::runtime_error{"Durable_RBTree: corrupt snapshot " + snapshot_path};
+        }
+        for (std::uint64_t i = 0; i < n; ++i) {
+            T key;
+            std::memcpy(&key, keys + i * sizeof(T), sizeof(T));
+            tree.insert(key);
+        }
+    }
+    // Log tail: replay up to the first torn or corrupt record, then cut it there.
+    // Records are idempotent, so replaying ones already in the snapshot is harmless.
+    auto log = read_file(log_path);
+    std::size_t good = 0;
+    for (; good + record_size <= log.size(); good += record_size) {
+        const char* r = log.data() + good;
+        std::uint32_t crc;
+        std::memcpy(&crc, r + 1 + sizeof(T), sizeof crc);
+        if (crc != crc32(r, 1 + sizeof(T))) {
+            break;
+        }
+        T key;
+        std::memcpy(&key, r + 1, sizeof(T));
+        if (static_cast<Op>(r[0]) == Op::insert) {
+            if (!tree.contains(key)) {
+                tree.insert(key);
+            }
+        } else {
+            tree.Delete(key);
+        }
+    }
+    log_fd = ::open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd < 0) {
+        throw std::system_error{errno, std::generic_category(), "open " + log_path};
+    }
+    if (good != log.size() && ::ftruncate(log_fd, static_cast<off_t>(good)) < 0) {
+        throw std::system_error{errno, std::generic_category(), "ftruncate " + log_path};
+    }
+    log_bytes = good;
+}
+
+template <typename T, typename CMP, typename B>
+bool Durable_RBTree<T,CMP,B>::insert(const T& key){
+    std::unique_lock<std::mutex> lk{m};
+    if (will_contain(key)) {
+        return false;
+    }
+    commit(lk, Op::insert, key);
+    return true;
+}
+
+template <typename T, typename CMP, typename B>
+bool Durable_RBTree<T,CMP,B>::Delete(const T& key){
+    std::unique_lock<std::mutex> lk{m};
+    if (!will_contain(key)) {
+        return false;
+    }
+    commit(lk, Op::remove, key);
+    return true;
+}
+
+template <typename T, typename CMP, typename B>
+void Durable_RBTree<T,CMP,B>::commit(std::unique_lock<std::mutex>& lk, Op op, const T& key){
+    char r[record_size];
+    r[0] = static_cast<char>(op);
+    std::memcpy(r + 1, &key, sizeof(T));
+    std::uint32_t crc = crc32(r, 1 + sizeof(T));
+    std::memcpy(r + 1 + sizeof(T), &crc, sizeof crc);
+    if (broken) {
+        throw std::runtime_error{"Durable_RBTree: " + log_path + " is damaged after a failed write"};
+    }
+    const std::uint64_t lsn = ++appended;
+
+    if (!group_commit) {
+        try {
+            write_all(log_fd, r, record_size);
+            sync_file(log_fd);
+        } catch (...) {
+            fail(std::current_exception());
+            throw;
+        }
+        apply(r, record_size, lsn);
+        ++syncs;
+    } else {
+        pending.insert(pending.end(), r, r + record_size);
+        unapplied[key] = Unapplied{op, lsn};
+    }
+    for (;;) {
+        for (const auto& f : failures) {
+            if (f.from < lsn && lsn <= f.upto) {
+                std::rethrow_exception(f.error);
+            }
+        }
+        if (durable >= lsn) {
+            break;
+        }
+        if (flushing) {
+            flushed.wait(lk);
+            continue;
+        }
+        // Become the leader: flush everything queued so far outside the lock
+        flushing = true;
+        std::vector<char> batch;
+        batch.swap(pending);
+        const std::uint64_t upto = appended;
+        lk.unlock();
+        try {
+            write_all(log_fd, batch.data(), batch.size());
+            sync_file(log_fd);
+        } catch (...) {
+            lk.lock();
+            flushing = false;
+            fail(std::current_exception());
+            throw;
+        }
+        lk.lock();
+        flushing = false;
+        apply(batch.data(), batch.size(), upto);
+        ++syncs;
+        flushed.notify_all();
+    }
+    if (checkpoint_every && appended - checkpointed >= checkpoint_every) {
+        checkpoint(lk);
+    }
+}
+
+template <typename T, typename CMP, typename B>
+void Durable_RBTree<T,CMP,B>::apply(const char* bytes, std::size_t n, std::uint64_t upto){
+    for (const char* r = bytes; r != bytes + n; r += record_size) {
+        T key;
+        std::memcpy(&key, r + 1, sizeof(T));
+        if (static_cast<Op>(r[0]) == Op::insert) {
+            tree.insert(key);
+        } else {
+            tree.Delete(key);
+        }
+        auto it = unapplied.find(key);
+        if (it != unapplied.end() && it->second.lsn <= upto) {
+            unapplied.erase(it);
+        }
+    }
+    durable = upto;
+    log_bytes += n;
+}
+
+template <typename T, typename CMP, typename B>
+void Durable_RBTree<T,CMP,B>::fail(std::exception_ptr error){
+    // Later records may depend on the dropped ones (a Delete of a key whose
+    // insert failed), so they all go, and their callers all get the error:
+    failures.push_back(Failure{durable, appended, error});
+    pending.clear();
+    unapplied.clear();
+    // Part of the batch may have reached the file: recovery would stop at
+    // the torn record and miss everything logged after it.
+    if (::ftruncate(log_fd, static_cast<off_t>(log_bytes)) < 0) {
+        broken = true;
+    }
+    flushed.notify_all();
+}
+
+template <typename T, typename CMP, typename B>
+void Durable_RBTree<T,CMP,B>::checkpoint(std::unique_lock<std::mutex>& lk){
+    // The tree holds every durable change; records still pending go to the
+    // truncated log with the next flush:
+    while (flushing) {
+        flushed.wait(lk);
+    }
+    std::vector<char> snap;
+    std::uint64_t n = tree.size();
+    snap.resize(sizeof n + n * sizeof(T) + sizeof(std::uint32_t));
+    std::memcpy(snap.data(), &n, sizeof n);
+    char* keys = snap.data() + sizeof n;
+    for (const auto& key : tree) {
+        std::memcpy(keys, &key, sizeof(T));
+        keys += sizeof(T);
+    }
+    std::uint32_t crc = crc32(snap.data() + sizeof n, n * sizeof(T));
+    std::memcpy(keys, &crc, sizeof crc);
+
+    const std::string tmp = snapshot_path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::system_error{errno, std::generic_category(), "open " + tmp};
+    }
+    try {
+        write_all(fd, snap.data(), snap.size());
+        sync_file(fd);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    std::filesystem::rename(tmp, snapshot_path);
+    int dir = ::open(std::filesystem::path(snapshot_path).parent_path().c_str(), O_RDONLY);
+    if (dir >= 0) {
+        ::fsync(dir);
+        ::close(dir);
+    }
+    // Only now is the log redundant:
+    if (::ftruncate(log_fd, 0) < 0) {
+        throw std::system_error{errno, std::generic_category(), "ftruncate " + log_path};
+    }
+    sync_file(log_fd);
+    log_bytes = 0;
+    checkpointed = appended;
+}
+
+#endif
@@ -0,0 +1,466 @@
+// Trace replay driver: runs a recorded or synthetic workload through RBTree.
+//
+//   replay.x run <trace> [threads] [--phases]
+//   replay.x gen uniform|zipf|window <ops> <keys> <trace> [--text]
+//
+// A trace is either binary, the magic "RBTRACE1" followed by 16-byte
+// Trace_records in native byte order, or text, one operation per line:
+//
+//   i 42      insert 42
+//   d 42      delete 42
+//   l 42      look 42 up
+//   r 10 20   scan the keys in [10, 20]
+//
+// with '#' starting a comment. The file is memory-mapped and parsed in
+// place as it is replayed, so traces larger than memory stream through the
+// page cache. With several threads, the inserts that open the trace (the
+// prefill of a generated one) are replayed first on one thread, then each
+// thread replays a contiguous slice of the rest against the same tree,
+// behind a shared_mutex.
+
+#include "RBTree.hpp"
+#include <shared_mutex>
+#include <fcntl.h>    // for open
+#include <unistd.h>   // for close
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
+
+enum class Op : std::uint8_t {insert, Delete, lookup, range};
+constexpr std::size_t op_count = 4;
+constexpr const char* op_names[op_count] = {"insert", "Delete", "lookup", "range"};
+
+struct Trace_record {
+    std::int64_t key;
+    std::uint32_t span; // a range covers [key, key + span]
+    Op op;
+    std::uint8_t unused[3];
+};
+static_assert(sizeof(Trace_record) == 16);
+
+constexpr std::string_view trace_magic = "RBTRACE1";
+
+// A read-only private mapping of a whole file:
+class Mapped_file {
+    const char* bytes = nullptr;
+    std::size_t length = 0;
+
+    public:
+    explicit Mapped_file(const std::string& path);
+    ~Mapped_file();
+    Mapped_file(const Mapped_file&) = delete;
+    Mapped_file& operator=(const Mapped_file&) = delete;
+    const char* data() const { return bytes; }
+    std::size_t size() const { return length; }
+};
+
+// Streams the records of [first, last), a slice of a mapped trace, without
+// copying it. Text slices must start at a line or between the fields of
+// two records.
+class Trace_reader {
+    const char* p;
+    const char* last;
+    bool binary;
+
+    void fail(const char* what) const { throw std::runtime_error{std::string{"bad trace: "} + what}; }
+    std::int64_t number();
+
+    public:
+    Trace_reader(const char* first, const char* last, bool binary) : p{first}, last{last}, binary{binary} {}
+    // Read the next record into r, false at the end of the slice:
+    bool next(Trace_record& r);
+    // The leading inserts of what is left, and the records after them:
+    std::pair<Trace_reader, Trace_reader> split_prefill() const;
+    // Splits what is left into `parts` slices holding about as many bytes:
+    std::vector<Trace_reader> split(unsigned parts) const;
+};
+
+// A reader over a whole mapped trace:
+Trace_reader read_trace(const Mapped_file& f);
+
+// What one thread saw: operations, keys found or scanned, and latencies.
+struct Replay_stats {
+    std::array<std::uint64_t, op_count> count{};
+    std::array<std::uint64_t, op_count> hits{};
+    std::array<Latency_histogram, op_count> latency;
+    void merge(const Replay_stats& other) {
+        for (std::size_t i = 0; i < op_count; ++i) {
+            count[i] += other.count[i];
+            hits[i] += other.hits[i];
+            latency[i].merge(other.latency[i]);
+        }
+    }
+};
+
+// Applies one record to the tree, returning the keys it found, inserted,
+// deleted or scanned:
+template <typename Tree>
+std::uint64_t apply_record(Tree& tree, const Trace_record& r) {
+    switch (r.op) {
+    case Op::insert:
+        return tree.try_insert(r.key);
+    case Op::Delete:
+        return tree.Delete(r.key);
+    case Op::lookup:
+        return tree.contains(r.key);
+    case Op::range: {
+        std::uint64_t n = 0;
+        // key + span may not fit in an int64_t, but *it - key does in unsigned:
+        for (auto it = tree.lower_bound(r.key);
+             it != tree.end() && static_cast<std::uint64_t>(*it) - static_cast<std::uint64_t>(r.key) <= r.span; ++it) {
+            ++n;
+        }
+        return n;
+    }
+    }
+    return 0;
+}
+
+// Replays one slice; with a mutex, writes take it exclusively and reads shared:
+template <typename Tree>
+void replay_slice(Tree& tree, Trace_reader reader, Replay_stats& stats, std::shared_mutex* mutex) {
+    const double ns_per_tick = Tick_clock::ns_per_tick();
+    Trace_record r;
+    while (reader.next(r)) {
+        const auto i = static_cast<std::size_t>(r.op);
+        auto t1 = Tick_clock::now();
+        std::uint64_t hits;
+        if (!mutex) {
+            hits = apply_record(tree, r);
+        } else if (r.op == Op::insert || r.op == Op::Delete) {
+            std::unique_lock lock{*mutex};
+            hits = apply_record(tree, r);
+        } else {
+            std::shared_lock lock{*mutex};
+            hits = apply_record(tree, r);
+        }
+        auto t2 = Tick_clock::now();
+        ++stats.count[i];
+        stats.hits[i] += hits;
+        stats.latency[i].record(static_cast<std::uint64_t>(static_cast<double>(t2 - t1) * ns_per_tick));
+    }
+}
+
+int run(const std::string& path, unsigned threads, bool phases) {
+    auto ms = [](auto t1, auto t2) { return std::chrono::duration<double, std::milli>(t2 - t1).count(); };
+    auto t1 = std::chrono::steady_clock::now();
+    Mapped_file trace{path};
+    auto t2 = std::chrono::steady_clock::now();
+    // A parse-only pass, so that the replay time can be told from the parsing:
+    std::uint64_t records = 0;
+    Trace_record r;
+    for (auto reader = read_trace(trace); reader.next(r);) {
+        ++records;
+    }
+    auto t3 = std::chrono::steady_clock::now();
+
+    RBTree<std::int64_t> tree;
+    Latency_log log;
+    if (phases && threads == 1) {
+        tree.record_latencies(&log);
+    }
+    std::shared_mutex mutex;
+    Trace_reader rest = read_trace(trace);
+    Replay_stats prefilled;
+    auto t4 = std::chrono::steady_clock::now();
+    // Otherwise the prefill would all land in slice 0, and the other slices
+    // would start on an empty tree:
+    if (threads > 1) {
+        auto [prefill, after] = rest.split_prefill();
+        replay_slice(tree, prefill, prefilled, nullptr);
+        rest = after;
+    }
+    auto slices = rest.split(threads);
+    std::vector<Replay_stats> stats(slices.size());
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < slices.size(); ++i) {
+        workers.emplace_back(replay_slice<RBTree<std::int64_t>>, std::ref(tree), slices[i], std::ref(stats[i]), &mutex);
+    }
+    replay_slice(tree, slices[0], stats[0], slices.size() > 1 ? &mutex : nullptr);
+    for (auto& w : workers) {
+        w.join();
+    }
+    auto t5 = std::chrono::steady_clock::now();
+    for (std::size_t i = 1; i < stats.size(); ++i) {
+        stats[0].merge(stats[i]);
+    }
+    stats[0].merge(prefilled);
+
+    std::cout << "Replaying " << records << " operations of " << path << " on " << slices.size() << " thread(s):\n";
+    std::cout << "map                       : " << ms(t1, t2) << " ms (" << trace.size() / 1024 << " KiB)\n";
+    std::cout << "parse only                : " << ms(t2, t3) << " ms\n";
+    std::cout << "replay                    : " << ms(t4, t5) << " ms ("
+              << static_cast<double>(records) / ms(t4, t5) / 1000 << " Mops/s)\n";
+    if (threads > 1) {
+        std::cout << "prefill on one thread     : " << prefilled.count[static_cast<std::size_t>(Op::insert)]
+                  << " inserts\n";
+    }
+    std::cout << "keys left                 : " << tree.size() << "\n";
+    auto flags = std::cout.flags();
+    auto precision = std::cout.precision();
+    std::cout << "op              count      hits   p50 ns   p99 ns  p99.9 ns    max ns\n";
+    for (std::size_t i = 0; i < op_count; ++i) {
+        const auto& h = stats[0].latency[i];
+        if (!h.count()) {
+            continue;
+        }
+        std::cout << std::left << std::setw(8) << op_names[i] << std::right << std::setw(13) << stats[0].count[i]
+                  << std::setw(10) << stats[0].hits[i] << std::setw(9) << h.percentile(50) << std::setw(9)
+                  << h.percentile(99) << std::setw(10) << h.percentile(99.9) << std::setw(10) << h.max() << '\n';
+    }
+    std::cout.flags(flags);
+    std::cout.precision(precision);
+    if (phases && threads == 1) {
+        std::cout << "\nPhases inside the tree:\n";
+        log.report(std::cout);
+    } else if (phases) {
+        std::cerr << "--phases needs a single thread\n";
+    }
+    return 0;
+}
+
+///////////////////////// TRACE GENERATORS /////////////////////////
+// Writes records either in binary or as text, through a buffer:
+class Trace_writer {
+    std::ofstream out;
+    bool text;
+
+    public:
+    Trace_writer(const std::string& path, bool text) : out{path, std::ios::binary}, text{text} {
+        if (!out) {
+            throw std::system_error{errno, std::generic_category(), "open " + path};
+        }
+        if (!text) {
+            out.write(trace_magic.data(), static_cast<std::streamsize>(trace_magic.size()));
+        }
+    }
+    void write(Op op, std::int64_t key, std::uint32_t span = 0) {
+        if (text) {
+            out << "idlr"[static_cast<std::size_t>(op)] << ' ' << key;
+            if (op == Op::range) {
+                out << ' ' << key + span;
+            }
+            out << '\n';
+        } else {
+            Trace_record r{key, span, op, {}};
+            out.write(reinterpret_cast<const char*>(&r), sizeof r);
+        }
+    }
+};
+
+// Uniform and Zipf traces: `keys` distinct keys, and an operation mix of
+// 60% lookups, 20% inserts, 15% deletes and 5% scans of 100 keys. The tree
+// is first filled with every other key. Zipf ranks (s = 0.99) are shuffled
+// over the keys, so the hot keys are spread across the tree.
+void generate_mix(Trace_writer& out, std::size_t ops, std::int64_t keys, bool zipf) {
+    std::mt19937_64 rng{42};
+    std::vector<std::int64_t> rank_to_key;
+    std::discrete_distribution<std::int64_t> zipf_rank;
+    if (zipf) {
+        rank_to_key.resize(static_cast<std::size_t>(keys));
+        std::iota(rank_to_key.begin(), rank_to_key.end(), 0);
+        std::shuffle(rank_to_key.begin(), rank_to_key.end(), rng);
+        std::vector<double> weights(static_cast<std::size_t>(keys));
+        for (std::size_t i = 0; i < weights.size(); ++i) {
+            weights[i] = 1 / std::pow(static_cast<double>(i + 1), 0.99);
+        }
+        zipf_rank = std::discrete_distribution<std::int64_t>{weights.begin(), weights.end()};
+    }
+    std::uniform_int_distribution<std::int64_t> uniform{0, keys - 1};
+    std::uniform_int_distribution<int> percent{0, 99};
+    for (std::int64_t k = 0; k < keys; k += 2) {
+        out.write(Op::insert, k);
+    }
+    for (std::size_t i = 0; i < ops; ++i) {
+        const std::int64_t key = zipf ? rank_to_key[static_cast<std::size_t>(zipf_rank(rng))] : uniform(rng);
+        const int p = percent(rng);
+        if (p < 60) {
+            out.write(Op::lookup, key);
+        } else if (p < 80) {
+            out.write(Op::insert, key);
+        } else if (p < 95) {
+            out.write(Op::Delete, key);
+        } else {
+            out.write(Op::range, key, 100);
+        }
+    }
+}
+
+// Sliding window: key i is inserted, the key `keys` before it deleted, and
+// two lookups hit random keys of the window (one in four falls just past it).
+void generate_window(Trace_writer& out, std::size_t ops, std::int64_t keys) {
+    std::mt19937_64 rng{42};
+    for (std::int64_t i = 0; static_cast<std::size_t>(i) < ops; ++i) {
+        out.write(Op::insert, i);
+        if (i >= keys) {
+            out.write(Op::Delete, i - keys);
+        }
+        const std::int64_t low = std::max<std::int64_t>(0, i - keys + 1);
+        std::uniform_int_distribution<std::int64_t> in_window{low, i + (i - low + 1) / 3};
+        out.write(Op::lookup, in_window(rng));
+        out.write(Op::lookup, in_window(rng));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const std::vector<std::string> args(argv + 1, argv + argc);
+    auto has = [&args](const char* flag) { return std::find(args.begin(), args.end(), flag) != args.end(); };
+    try {
+        if (args.size() >= 2 && args[0] == "run") {
+            unsigned threads = args.size() > 2 && args[2][0] != '-' ? static_cast<unsigned>(std::stoul(args[2])) : 1;
+            return run(args[1], std::max(threads, 1u), has("--phases"));
+        }
+        if (args.size() >= 5 && args[0] == "gen") {
+            Trace_writer out{args[4], has("--text")};
+            const std::size_t ops = std::stoul(args[2]);
+            const std::int64_t keys = std::max<std::int64_t>(1, std::stoll(args[3]));
+            if (args[1] == "uniform" || args[1] == "zipf") {
+                generate_mix(out, ops, keys, args[1] == "zipf");
+                return 0;
+            }
+            if (args[1] == "window") {
+                generate_window(out, ops, keys);
+                return 0;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    std::cerr << "usage: " << argv[0] << " run <trace> [threads] [--phases]\n"
+              << "       " << argv[0] << " gen uniform|zipf|window <ops> <keys> <trace> [--text]\n";
+    return 2;
+}
+
+///////////////////////// Mapped_file IMPLEMENTATION /////////////////////////
+Mapped_file::Mapped_file(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::system_error{errno, std::generic_category(), "open " + path};
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error{err, std::generic_category(), "fstat " + path};
+    }
+    length = static_cast<std::size_t>(st.st_size);
+    if (length) {
+        void* m = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error{err, std::generic_category(), "mmap " + path};
+        }
+        ::madvise(m, length, MADV_SEQUENTIAL);
+        bytes = static_cast<const char*>(m);
+    }
+    ::close(fd); // the mapping keeps the file open
+}
+
+Mapped_file::~Mapped_file() {
+    if (bytes) {
+        ::munmap(const_cast<char*>(bytes), length);
+    }
+}
+
+///////////////////////// Trace_reader IMPLEMENTATION /////////////////////////
+std::int64_t Trace_reader::number() {
+    while (p < last && (*p == ' ' || *p == '\t')) {
+        ++p;
+    }
+    std::int64_t n = 0;
+    auto [end, ec] = std::from_chars(p, last, n);
+    if (ec != std::errc{}) {
+        fail("expected a number");
+    }
+    p = end;
+    return n;
+}
+
+bool Trace_reader::next(Trace_record& r) {
+    if (binary) {
+        if (p == last) {
+            return false;
+        }
+        std::memcpy(&r, p, sizeof r); // compiles to two loads
+        p += sizeof r;
+        if (static_cast<std::size_t>(r.op) >= op_count) {
+            fail("unknown operation");
+        }
+        return true;
+    }
+    while (p < last) {
+        const char c = *p++;
+        if (c == '\n' || c == '\r' || c == ' ' || c == '\t') {
+            continue;
+        }
+        if (c == '#') {
+            p = std::find(p, last, '\n');
+            continue;
+        }
+        switch (c) {
+        case 'i': r.op = Op::insert; break;
+        case 'd': r.op = Op::Delete; break;
+        case 'l': r.op = Op::lookup; break;
+        case 'r': r.op = Op::range; break;
+        default: fail("unknown operation");
+        }
+        r.key = number();
+        r.span = 0;
+        if (r.op == Op::range) {
+            const std::int64_t hi = number();
+            const std::uint64_t span = static_cast<std::uint64_t>(hi) - static_cast<std::uint64_t>(r.key);
+            if (hi < r.key || span > std::numeric_limits<std::uint32_t>::max()) {
+                fail("bad range");
+            }
+            r.span = static_cast<std::uint32_t>(span);
+        }
+        return true;
+    }
+    return false;
+}
+
+std::pair<Trace_reader, Trace_reader> Trace_reader::split_prefill() const {
+    Trace_reader ahead = *this;
+    const char* mid = p;
+    Trace_record r;
+    while (ahead.next(r) && r.op == Op::insert) {
+        mid = ahead.p;
+    }
+    return {Trace_reader{p, mid, binary}, Trace_reader{mid, last, binary}};
+}
+
+std::vector<Trace_reader> Trace_reader::split(unsigned parts) const {
+    std::vector<Trace_reader> slices;
+    if (binary) {
+        const std::size_t n = static_cast<std::size_t>(last - p) / sizeof(Trace_record);
+        for (unsigned i = 0; i < parts; ++i) {
+            slices.emplace_back(p + n * i / parts * sizeof(Trace_record),
+                                p + n * (i + 1) / parts * sizeof(Trace_record), true);
+        }
+        return slices;
+    }
+    // Text slices end after the first newline past their share of the bytes:
+    const std::size_t size = static_cast<std::size_t>(last - p);
+    const char* begin = p;
+    for (unsigned i = 1; i <= parts; ++i) {
+        const char* end = i == parts ? last : std::find(p + size * i / parts, last, '\n');
+        end = std::max(begin, end == last ? last : end + 1);
+        slices.emplace_back(begin, end, false);
+        begin = end;
+    }
+    return slices;
+}
+
+Trace_reader read_trace(const Mapped_file& f) {
+    const char* first = f.data();
+    const char* last = f.data() + f.size();
+    const bool binary = f.size() >= trace_magic.size() && std::string_view{first, trace_magic.size()} == trace_magic;
+    if (binary) {
+        first += trace_magic.size();
+        if (static_cast<std::size_t>(last - first) % sizeof(Trace_record)) {
+            throw std::runtime_error{"bad trace: truncated record"};
+        }
+    }
+    return Trace_reader{first, last, binary};
+}